@@ -0,0 +1,130 @@
+/* Interpreter throughput, build with -DCMAKE_BUILD_TYPE=Release
+ *
+ *   emulator_bench [count]
+ *
+ * Steps `count` instructions, then runs each engine for `count` cycles, then
+ * the JIT for as long in slices with and without TimeTravel recording, once
+ * more with a poll loop in the program, then forks a running instance
+ * `count / 1000` times.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+
+#include <fmt/format.h>
+
+#include <Mcu.hpp>
+#include <TimeTravel.hpp>
+#include <opcodes.hpp>
+
+namespace {
+    /* Fills memory at 0x4000 with a running sum, never stops */
+    const std::vector<u8> program {
+        LDI, 0x0C, 0x40,
+        LDI, 0x0D, 0x00,
+        LDI, 0x01, 0x03,
+        ADD, 0x01,
+        ST,  0x00,
+        INC, 0x0D,
+        CPI, 0x0D, 0x00,
+        BRNZ, 0x00, 0x09,
+        ADC, 0x20,
+        JMP, 0x00, 0x09,
+    };
+
+    /* The same waiting on port 0x01 every 256 bytes */
+    const std::vector<u8> polling {
+        LDI, 0x0C, 0x40,
+        LDI, 0x0D, 0x00,
+        LDI, 0x01, 0x03,
+        ADD, 0x01,
+        ST,  0x00,
+        INC, 0x0D,
+        CPI, 0x0D, 0x00,
+        BRNZ, 0x00, 0x09,
+        ADC, 0x20,
+        IN,  0x02, 0x01,
+        CPI, 0x02, 0x00,
+        BRZ, 0x00, 0x17,
+        JMP, 0x00, 0x09,
+    };
+
+    /* What port 0x01 reads, see sliced() */
+    u8 level = 0x00;
+
+    template <typename F>
+    void measure(const char* name, u64 count, F run, const std::vector<u8>& image = program) {
+        auto mcu = std::make_unique<Mcu>();
+        mcu->load_program(image);
+        mcu->io_handlers[0x01] = IoHandler {
+            .get = []() { return level; },
+            .pure = true,
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        run(*mcu, count);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        fmt::print("{:<20} {:>8.1f} M instructions/s {:>8.1f} emulated MHz\n", name,
+            static_cast<double>(mcu->instructions) / elapsed.count() / 1e6,
+            static_cast<double>(mcu->cycles) / elapsed.count() / 1e6);
+    }
+
+    /* Runs for `count` cycles in slices, as a debugger would, with port 0x01
+     * reading zero every other slice */
+    template <typename F>
+    void sliced(u64 count, F run) {
+        for (u64 done = 0; done < count; done += 100'000) {
+            level = static_cast<u8>(done / 100'000 % 2);
+            run(std::min<u64>(100'000, count - done));
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    u64 count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100'000'000;
+
+    measure("step()", count, [](Mcu& mcu, u64 count) {
+        for (u64 i = 0; i < count; i++) {
+            mcu.step();
+        }
+    });
+
+    for (auto [ name, engine ] : { std::pair { "Switch", Mcu::Engine::Switch }, { "Threaded", Mcu::Engine::Threaded }, { "Jit", Mcu::Engine::Jit } }) {
+        measure(name, count, [engine](Mcu& mcu, u64 count) {
+            mcu.engine = engine;
+            mcu.run(count);
+        });
+    }
+
+    for (auto [ suffix, image ] : { std::pair { "", &program }, { " polling", &polling } }) {
+        measure(fmt::format("Jit sliced{}", suffix).c_str(), count, [](Mcu& mcu, u64 count) {
+            mcu.engine = Mcu::Engine::Jit;
+            sliced(count, [&mcu](u64 budget) { mcu.run(budget); });
+        }, *image);
+
+        measure(fmt::format("TimeTravel{}", suffix).c_str(), count, [](Mcu& mcu, u64 count) {
+            mcu.engine = Mcu::Engine::Jit;
+            TimeTravel travel { mcu };
+            sliced(count, [&travel](u64 budget) { travel.run(budget); });
+        }, *image);
+    }
+
+    /* Between forks the parent writes a page, as a branching search would */
+    auto parent = std::make_unique<Mcu>();
+    parent->engine = Mcu::Engine::Threaded;
+    parent->load_program(program);
+    parent->run(100'000);
+
+    u64 forks = std::max<u64>(count / 1000, 1);
+    auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < forks; i++) {
+        parent->run(50);
+        auto child = parent->fork();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    fmt::print("{:<20} {:>8.2f} us per fork\n", "fork()", elapsed.count() / static_cast<double>(forks) * 1e6);
+}
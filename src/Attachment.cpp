@@ -0,0 +1,16 @@
+#include <Attachment.hpp>
+
+#include <algorithm>
+
+#include <Mcu.hpp>
+
+Attachment::Attachment(McuBase& mcu)
+    : host { mcu }
+{
+    this->host.attachments.push_back(this);
+}
+
+Attachment::~Attachment() {
+    auto& attachments = this->host.attachments;
+    attachments.erase(std::remove(attachments.begin(), attachments.end(), this), attachments.end());
+}
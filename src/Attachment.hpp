@@ -0,0 +1,29 @@
+#pragma once
+
+class McuBase;
+
+/* Anything attached to an Mcu through port handlers, scheduled events or
+ * the tap: the devices and the wrappers recording or replaying a run.
+ *
+ * Copying the Mcu copies those along, still acting on the attachment of
+ * the original, so BasicMcu::fork() has every attachment leave the fork:
+ * a fork starts with nothing attached and the parent goes on as it was.
+ * Devices are attached to the fork anew, usually as copies of the parent's
+ * taken with their forking constructor, e.g. `Buttons { *fork, buttons }`.
+ */
+class Attachment {
+public:
+    /* Registers with `mcu` for as long as this lives */
+    explicit Attachment(McuBase& mcu);
+    virtual ~Attachment();
+
+    Attachment(const Attachment&) = delete;
+    Attachment& operator=(const Attachment&) = delete;
+
+    /* Takes out of `fork`, a copy of the Mcu this is attached to, what
+     * attaching left in it */
+    virtual void leave(McuBase& fork) const = 0;
+
+private:
+    McuBase& host;
+};
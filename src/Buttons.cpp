@@ -0,0 +1,146 @@
+#include <Buttons.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+#include <interrupts.hpp>
+
+Buttons::Buttons(Mcu& mcu, u8 port)
+    : Attachment { mcu }
+    , mcu { mcu }
+    , port { port }
+{
+    this->mcu.io_handlers[port] = IoHandler {
+        .get = [this]() {
+            return this->held;
+        },
+        .pure = true,
+    };
+}
+
+Buttons::Buttons(Mcu& mcu, const Buttons& other)
+    : Buttons { mcu, other.port }
+{
+    this->held = other.held;
+    this->inputs = other.inputs;
+    this->reschedule();
+}
+
+Buttons::~Buttons() {
+    if (this->event_cycle != Scheduler::never) {
+        this->mcu.scheduler.cancel(this->event);
+    }
+    this->mcu.io_handlers.erase(this->port);
+}
+
+void Buttons::queue(const Input& input) {
+    if (input.button >= count) {
+        throw std::invalid_argument { fmt::format("No button {}", input.button) };
+    }
+
+    /* After everything at the same cycle */
+    auto it = std::upper_bound(this->inputs.begin(), this->inputs.end(), input.cycle, [](u64 cycle, const Input& other) {
+        return cycle < other.cycle;
+    });
+    this->inputs.insert(it, input);
+
+    this->reschedule();
+}
+
+void Buttons::queue(const std::vector<Input>& inputs) {
+    for (const Input& input : inputs) {
+        this->queue(input);
+    }
+}
+
+void Buttons::add_to(SaveState& state, SaveState::Tag tag) {
+    state.add_device(tag,
+        [this](StateWriter& writer) { this->save(writer); },
+        [this](StateReader& reader) { this->load(reader); }
+    );
+}
+
+void Buttons::leave(McuBase& fork) const {
+    /* Attached to an Mcu, so its forks are Mcus too */
+    Mcu& copy = static_cast<Mcu&>(fork);
+
+    if (this->event_cycle != Scheduler::never) {
+        copy.scheduler.cancel(this->event);
+    }
+    copy.io_handlers.erase(this->port);
+}
+
+void Buttons::apply(u64 cycle) {
+    this->event_cycle = Scheduler::never;
+
+    u8 before = this->held;
+    while (!this->inputs.empty() && this->inputs.front().cycle <= cycle) {
+        const Input& input = this->inputs.front();
+        if (input.pressed) {
+            this->held |= 1u << input.button;
+        }
+        else {
+            this->held &= ~(1u << input.button);
+        }
+        this->inputs.pop_front();
+    }
+
+    if (this->held != before) {
+        this->mcu.raise_interrupts(1u << BUTTON_INTERRUPT);
+    }
+
+    this->reschedule();
+}
+
+void Buttons::reschedule() {
+    if (this->inputs.empty() || this->inputs.front().cycle >= this->event_cycle) {
+        return;
+    }
+
+    if (this->event_cycle != Scheduler::never) {
+        this->mcu.scheduler.cancel(this->event);
+    }
+
+    this->event_cycle = this->inputs.front().cycle;
+    this->event = this->mcu.scheduler.schedule(this->event_cycle, [this](u64 cycle) {
+        this->apply(cycle);
+    });
+}
+
+void Buttons::save(StateWriter& writer) const {
+    writer.write_u8(this->held);
+    writer.write_u32(static_cast<u32>(this->inputs.size()));
+    for (const Input& input : this->inputs) {
+        writer.write_u64(input.cycle);
+        writer.write_u8(input.button);
+        writer.write_u8(input.pressed);
+    }
+}
+
+void Buttons::load(StateReader& reader) {
+    u8 held = reader.read_u8();
+
+    std::deque<Input> inputs;
+    for (u32 left = reader.read_u32(); left > 0; left--) {
+        Input input {};
+        input.cycle = reader.read_u64();
+        input.button = reader.read_u8();
+        input.pressed = reader.read_u8() != 0;
+
+        if (input.button >= count || (!inputs.empty() && input.cycle < inputs.back().cycle)) {
+            throw save_state_error { "Malformed buttons chunk" };
+        }
+        inputs.push_back(input);
+    }
+
+    if (this->event_cycle != Scheduler::never) {
+        this->mcu.scheduler.cancel(this->event);
+        this->event_cycle = Scheduler::never;
+    }
+
+    this->held = held;
+    this->inputs = std::move(inputs);
+    this->reschedule();
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <Attachment.hpp>
+#include <Mcu.hpp>
+#include <SaveState.hpp>
+#include <Scheduler.hpp>
+#include <typedefs.hpp>
+
+/* Up to eight buttons read from one port of an Mcu, a bit per button, set
+ * while it is held.
+ *
+ * Presses and releases are queued ahead of time with the cycle they happen
+ * at and applied by a scheduler event at exactly that cycle, raising
+ * BUTTON_INTERRUPT whenever the state changes, so scripted input runs at
+ * full speed. Inputs at the same cycle apply in the order they were
+ * queued; one queued for a cycle already past applies as soon as the run
+ * loop gets to it. The port only changes at events, so loops polling it
+ * are skipped up to the next one.
+ */
+class Buttons : public Attachment {
+public:
+    static constexpr u8 count = 8;
+
+    struct Input {
+        u64 cycle;
+        u8 button;
+        bool pressed;
+    };
+
+    Buttons(Mcu& mcu, u8 port);
+
+    /* Attaches a copy of `other` to `mcu`, usually a fork of the Mcu `other`
+     * is attached to, holding the same buttons with the same inputs queued */
+    Buttons(Mcu& mcu, const Buttons& other);
+
+    ~Buttons() override;
+
+    Buttons(const Buttons&) = delete;
+    Buttons& operator=(const Buttons&) = delete;
+
+    /* Throws std::invalid_argument for a button past `count` */
+    void queue(const Input& input);
+    void queue(const std::vector<Input>& inputs);
+
+    /* Buttons held right now */
+    u8 state() const {
+        return this->held;
+    }
+
+    /* Inputs not applied yet */
+    size_t queued() const {
+        return this->inputs.size();
+    }
+
+    /* Saves and restores the buttons held and the inputs still queued with
+     * `state` under `tag` */
+    void add_to(SaveState& state, SaveState::Tag tag = { 'B', 'T', 'N', 'S' });
+
+    void leave(McuBase& fork) const override;
+
+private:
+    /* Applies every input due by `cycle` */
+    void apply(u64 cycle);
+
+    /* Keeps one event scheduled at the first queued input */
+    void reschedule();
+
+    void save(StateWriter& writer) const;
+
+    /* Throws save_state_error, leaving the buttons as they were, if the
+     * chunk does not hold a valid state */
+    void load(StateReader& reader);
+
+    Mcu& mcu;
+    u8 port;
+    u8 held = 0x00;
+
+    /* Ordered by cycle */
+    std::deque<Input> inputs;
+
+    Scheduler::EventId event = 0;
+    u64 event_cycle = Scheduler::never;
+};
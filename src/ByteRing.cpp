@@ -0,0 +1,64 @@
+#include <ByteRing.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    size_t round_up_pow2(size_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1u;
+        }
+        return result;
+    }
+}
+
+ByteRing::ByteRing(size_t capacity)
+    : buffer(round_up_pow2(std::max<size_t>(capacity, 1)))
+    , mask { this->buffer.size() - 1 }
+{ }
+
+size_t ByteRing::write(const u8* data, size_t size) {
+    const size_t tail = this->tail.load(std::memory_order_relaxed);
+
+    if (this->capacity() - (tail - this->cached_head) < size) {
+        this->cached_head = this->head.load(std::memory_order_acquire);
+    }
+
+    size = std::min(size, this->capacity() - (tail - this->cached_head));
+
+    /* In at most two pieces, the second one after wrapping around */
+    size_t offset = tail & this->mask;
+    size_t first = std::min(size, this->capacity() - offset);
+    std::memcpy(&this->buffer[offset], data, first);
+    std::memcpy(&this->buffer[0], data + first, size - first);
+
+    this->tail.store(tail + size, std::memory_order_release);
+    return size;
+}
+
+bool ByteRing::push(u8 value) {
+    return this->write(&value, 1) == 1;
+}
+
+size_t ByteRing::read(u8* data, size_t size) {
+    const size_t head = this->head.load(std::memory_order_relaxed);
+
+    if (this->cached_tail - head < size) {
+        this->cached_tail = this->tail.load(std::memory_order_acquire);
+    }
+
+    size = std::min(size, this->cached_tail - head);
+
+    size_t offset = head & this->mask;
+    size_t first = std::min(size, this->capacity() - offset);
+    std::memcpy(data, &this->buffer[offset], first);
+    std::memcpy(data + first, &this->buffer[0], size - first);
+
+    this->head.store(head + size, std::memory_order_release);
+    return size;
+}
+
+bool ByteRing::pop(u8& value) {
+    return this->read(&value, 1) == 1;
+}
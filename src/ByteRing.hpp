@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include <typedefs.hpp>
+
+/* Lock-free queue of bytes between one producer thread and one consumer
+ * thread, for streaming data in and out of a device without a callback per
+ * byte.
+ *
+ * The capacity is rounded up to a power of two. Each side owns one index
+ * and keeps a copy of the other's, reloading it only when the copy says the
+ * ring is full or empty, so the threads rarely touch each other's cache
+ * lines.
+ */
+class ByteRing {
+public:
+    explicit ByteRing(size_t capacity);
+
+    ByteRing(const ByteRing&) = delete;
+    ByteRing& operator=(const ByteRing&) = delete;
+
+    /* Producer side: queues as much of `data` as fits, returns how much */
+    size_t write(const u8* data, size_t size);
+    bool push(u8 value);
+
+    /* Consumer side: takes up to `size` bytes, returns how many */
+    size_t read(u8* data, size_t size);
+    bool pop(u8& value);
+
+    /* Exact only on the consumer side, a lower bound on the producer side */
+    size_t size() const {
+        return this->tail.load(std::memory_order_acquire) - this->head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return this->size() == 0;
+    }
+
+    size_t capacity() const {
+        return this->buffer.size();
+    }
+
+private:
+    std::vector<u8> buffer;
+    size_t mask;
+
+    /* Free-running indices, wrapped with `mask` on access */
+
+    /* Consumer */
+    alignas(64) std::atomic<size_t> head { 0 };
+    size_t cached_tail = 0;
+
+    /* Producer */
+    alignas(64) std::atomic<size_t> tail { 0 };
+    size_t cached_head = 0;
+};
@@ -0,0 +1,125 @@
+#include <Display.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+#include <interrupts.hpp>
+
+Display::Display(Mcu& mcu, u16 address, u16 width, u16 height, u64 cycles_per_frame)
+    : Attachment { mcu }
+    , address { address }
+    , width { width }
+    , height { height }
+    , mcu { mcu }
+    , cycles_per_frame { std::max<u64>(cycles_per_frame, 1) }
+    , pixels(static_cast<size_t>(width) * height)
+    , latest(this->pixels.size())
+    , dirty((height + 63u) / 64u)
+{
+    if (address + this->pixels.size() > Memory::size) {
+        throw std::invalid_argument { "Framebuffer does not fit in memory" };
+    }
+
+    /* Whatever memory holds now is the first frame, all of it new */
+    this->mcu.memory.read(address, this->pixels.data(), static_cast<u32>(this->pixels.size()));
+    for (u16 y = 0; y < height; y++) {
+        this->dirty[y / 64u] |= u64 { 1 } << (y % 64u);
+    }
+
+    this->schedule(this->mcu.cycles + this->cycles_per_frame);
+}
+
+Display::Display(Mcu& mcu, const Display& other)
+    : Display { mcu, other.address, other.width, other.height, other.cycles_per_frame }
+{
+    this->frames = other.frames;
+    this->pixels = other.pixels;
+    this->dirty = other.dirty;
+
+    this->mcu.scheduler.cancel(this->event);
+    this->schedule(other.event_cycle);
+}
+
+Display::~Display() {
+    this->mcu.scheduler.cancel(this->event);
+}
+
+void Display::clear_dirty() {
+    std::fill(this->dirty.begin(), this->dirty.end(), 0);
+}
+
+void Display::add_to(SaveState& state, SaveState::Tag tag) {
+    state.add_device(tag,
+        [this](StateWriter& writer) { this->save(writer); },
+        [this](StateReader& reader) { this->load(reader); }
+    );
+}
+
+void Display::leave(McuBase& fork) const {
+    fork.scheduler.cancel(this->event);
+}
+
+void Display::vblank(u64 cycle) {
+    this->mcu.memory.read(this->address, this->latest.data(), static_cast<u32>(this->latest.size()));
+    const u8* source = this->latest.data();
+
+    for (u16 y = 0; y < this->height; y++) {
+        size_t offset = static_cast<size_t>(y) * this->width;
+        if (std::memcmp(&this->pixels[offset], source + offset, this->width) != 0) {
+            std::memcpy(&this->pixels[offset], source + offset, this->width);
+            this->dirty[y / 64u] |= u64 { 1 } << (y % 64u);
+        }
+    }
+
+    this->frames++;
+    this->mcu.raise_interrupts(1u << VBLANK_INTERRUPT);
+
+    this->schedule(cycle + this->cycles_per_frame);
+}
+
+void Display::schedule(u64 cycle) {
+    this->event_cycle = cycle;
+    this->event = this->mcu.scheduler.schedule(this->event_cycle, [this](u64 cycle) {
+        this->vblank(cycle);
+    });
+}
+
+void Display::save(StateWriter& writer) const {
+    writer.write_u16(this->width);
+    writer.write_u16(this->height);
+    writer.write_u64(this->frames);
+    writer.write_u64(this->event_cycle);
+    for (u64 word : this->dirty) {
+        writer.write_u64(word);
+    }
+    writer.write(this->pixels.data(), this->pixels.size());
+}
+
+void Display::load(StateReader& reader) {
+    u16 width = reader.read_u16();
+    u16 height = reader.read_u16();
+    if (width != this->width || height != this->height) {
+        throw save_state_error { fmt::format("Display chunk is for {}x{}, not {}x{}", width, height, this->width, this->height) };
+    }
+
+    u64 frames = reader.read_u64();
+    u64 event_cycle = reader.read_u64();
+
+    Bitmap dirty(this->dirty.size());
+    for (u64& word : dirty) {
+        word = reader.read_u64();
+    }
+
+    std::vector<u8> pixels(this->pixels.size());
+    reader.read(pixels.data(), pixels.size());
+
+    this->frames = frames;
+    this->dirty = std::move(dirty);
+    this->pixels = std::move(pixels);
+
+    this->mcu.scheduler.cancel(this->event);
+    this->schedule(event_cycle);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+
+#include <Attachment.hpp>
+#include <Mcu.hpp>
+#include <SaveState.hpp>
+#include <Scheduler.hpp>
+#include <typedefs.hpp>
+
+/* Framebuffer display reading `width` * `height` bytes of data memory from
+ * `address`, a byte per pixel, row after row.
+ *
+ * Every `cycles_per_frame` cycles a scheduler event ends the frame: rows
+ * that changed since the last one are copied into frame() and marked in
+ * dirty_rows(), then VBLANK_INTERRUPT is raised. A renderer uploads the
+ * dirty rows after a run and calls clear_dirty(); rows stay dirty until
+ * then, across any number of frames.
+ */
+class Display : public Attachment {
+public:
+    /* One bit per row, row `n` is bit `n % 64` of word `n / 64` */
+    using Bitmap = std::vector<u64>;
+
+    /* Throws std::invalid_argument if the framebuffer does not fit in
+     * memory */
+    Display(Mcu& mcu, u16 address, u16 width, u16 height, u64 cycles_per_frame);
+
+    /* Attaches a copy of `other` to `mcu`, usually a fork of the Mcu `other`
+     * is attached to, with the same last frame, dirty rows, frame count and
+     * next vblank */
+    Display(Mcu& mcu, const Display& other);
+
+    ~Display() override;
+
+    Display(const Display&) = delete;
+    Display& operator=(const Display&) = delete;
+
+    /* Contents at the end of the last frame */
+    const u8* frame() const {
+        return this->pixels.data();
+    }
+
+    const u8* row(u16 y) const {
+        return this->pixels.data() + static_cast<size_t>(y) * this->width;
+    }
+
+    bool is_dirty(u16 y) const {
+        return (this->dirty[y / 64u] >> (y % 64u) & 1u) != 0;
+    }
+
+    const Bitmap& dirty_rows() const {
+        return this->dirty;
+    }
+
+    void clear_dirty();
+
+    /* Saves and restores the last frame, the dirty rows, the frame count and
+     * the time of the next vblank with `state` under `tag` */
+    void add_to(SaveState& state, SaveState::Tag tag = { 'D', 'I', 'S', 'P' });
+
+    void leave(McuBase& fork) const override;
+
+    /* Frames ended so far */
+    u64 frames = 0;
+
+    const u16 address;
+    const u16 width;
+    const u16 height;
+
+private:
+    void vblank(u64 cycle);
+
+    /* Schedules the next vblank at `cycle` */
+    void schedule(u64 cycle);
+
+    void save(StateWriter& writer) const;
+
+    /* Throws save_state_error, leaving the display as it was, if the chunk
+     * is for another size of display or cut short */
+    void load(StateReader& reader);
+
+    Mcu& mcu;
+    u64 cycles_per_frame;
+
+    std::vector<u8> pixels;
+    Bitmap dirty;
+
+    /* The framebuffer as last read from memory, to compare rows against */
+    std::vector<u8> latest;
+
+    Scheduler::EventId event = 0;
+    u64 event_cycle = 0;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+#include <IoPorts.hpp>
+#include <typedefs.hpp>
+
+/* I/O bus policy dispatching to handlers registered in `io_handlers`.
+ *
+ * With a `tap` attached (an IoJournal) every port access goes through it
+ * instead, to be recorded or replayed, skipped poll loops included.
+ */
+class DynamicBus {
+public:
+    IoPorts io_handlers;
+    IoTap* tap = nullptr;
+
+    void io_read(u8 port, u8& value) {
+        if (this->tap != nullptr) {
+            this->tap->read(this->io_handlers, port, value);
+        }
+        else if (IoHandler* handler = this->io_handlers.find(port)) {
+            value = handler->get();
+        }
+    }
+
+    void io_write(u8 port, u8 value) {
+        if (this->tap != nullptr) {
+            this->tap->write(this->io_handlers, port, value);
+        }
+        else if (IoHandler* handler = this->io_handlers.find(port)) {
+            handler->set(value);
+        }
+    }
+
+    u64 io_peek(u8 port, u8& value) {
+        if (this->tap != nullptr) {
+            return this->tap->peek(this->io_handlers, port, value);
+        }
+
+        IoHandler* handler = this->io_handlers.find(port);
+        if (handler == nullptr) {
+            return UINT64_MAX;
+        }
+        if (!handler->pure) {
+            return 0;
+        }
+        value = handler->get();
+        return UINT64_MAX;
+    }
+
+    void io_skip(u8 port, u8 value, u64 reads) {
+        if (this->tap != nullptr) {
+            this->tap->skip(this->io_handlers, port, value, reads);
+        }
+    }
+};
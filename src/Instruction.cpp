@@ -0,0 +1,135 @@
+#include <Instruction.hpp>
+
+#include <util.hpp>
+
+namespace {
+    /* `head: IN r, port; CP(I) ...; branch head` with the branch at `addr` */
+    bool is_poll_loop(const std::array<u8, 0x10000>& program, u16 head, u16 addr) {
+        u16 compare = head + 3;
+
+        return program[head] == IN
+            && (program[compare] == CP || program[compare] == CPI)
+            && static_cast<u16>(compare + (program[compare] == CP ? 2 : 3)) == addr;
+    }
+
+    /* Superinstruction for `insn` followed by the branch at `next`, or 0 */
+    u8 fused_handler(const std::array<u8, 0x10000>& program, const Instruction& insn, u16 next) {
+        u8 branch = program[next];
+        if (branch != BRZ && branch != BRNZ) {
+            return 0;
+        }
+
+        /* Idle loop detection takes precedence */
+        if (decode(program, next).handler == IDLE_LOOP) {
+            return 0;
+        }
+
+        switch (insn.opcode) {
+            case CP: {
+                return branch == BRZ ? CP_BRZ : CP_BRNZ;
+            }
+            case CPI: {
+                return branch == BRZ ? CPI_BRZ : CPI_BRNZ;
+            }
+            case DEC: {
+                return branch == BRNZ ? DEC_BRNZ : 0;
+            }
+            default: {
+                return 0;
+            }
+        }
+    }
+}
+
+Instruction decode(const std::array<u8, 0x10000>& program, u16 addr) {
+    auto byte = [&](u16 offset) {
+        return program[static_cast<u16>(addr + offset)];
+    };
+
+    Instruction insn;
+    insn.opcode = byte(0);
+    insn.handler = insn.opcode;
+    insn.cycles = opcode_cycles[insn.opcode];
+
+    switch (insn.opcode) {
+        case NOP:
+        case SLEEP:
+        case BREAK:
+        case SEI:
+        case SEC:
+        case SEZ:
+        case CLI:
+        case CLC:
+        case CLZ:
+        case RET:
+        case RETI: {
+            insn.length = 1;
+            break;
+        }
+        case ADD:
+        case ADC:
+        case SUB:
+        case SBC:
+        case AND:
+        case OR:
+        case XOR:
+        case CP:
+        case MOV: {
+            insn.length = 2;
+            insn.a = high_nibble(byte(1));
+            insn.b = low_nibble(byte(1));
+            break;
+        }
+        case INC:
+        case DEC:
+        case LD:
+        case ST:
+        case PUSH:
+        case POP:
+        case LPM: {
+            insn.length = 2;
+            insn.a = low_nibble(byte(1));
+            break;
+        }
+        case CPI:
+        case LDI:
+        case IN:
+        case OUT: {
+            insn.length = 3;
+            insn.a = low_nibble(byte(1));
+            insn.b = byte(2);
+            break;
+        }
+        case JMP:
+        case CALL:
+        case BRC:
+        case BRNC:
+        case BRZ:
+        case BRNZ: {
+            insn.length = 3;
+            insn.target = static_cast<u16>(byte(1) << 8u | byte(2));
+
+            if (insn.opcode != CALL && (insn.target == addr || is_poll_loop(program, insn.target, addr))) {
+                insn.handler = IDLE_LOOP;
+            }
+            break;
+        }
+        default: {
+            /* Illegal, reported when executed */
+            insn.handler = ILLEGAL;
+            insn.length = 1;
+            break;
+        }
+    }
+
+    if (insn.opcode == CP || insn.opcode == CPI || insn.opcode == DEC) {
+        u16 next = addr + insn.length;
+
+        if (u8 handler = fused_handler(program, insn, next)) {
+            insn.handler = handler;
+            insn.target = static_cast<u16>(program[static_cast<u16>(next + 1)] << 8u | program[static_cast<u16>(next + 2)]);
+        }
+    }
+
+    return insn;
+}
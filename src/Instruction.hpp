@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+
+#include <cycles.hpp>
+#include <handlers.hpp>
+#include <opcodes.hpp>
+#include <typedefs.hpp>
+
+/* A single pre-decoded instruction.
+ *
+ * Operand encoding:
+ *   register pair       (ADD, MOV, ...)  a = destination, b = source
+ *   single register     (INC, PUSH, ...) a = register
+ *   register, immediate (LDI, CPI, IN)   a = register, b = immediate byte
+ *   address             (JMP, BRZ, ...)  target = absolute address
+ *   fused pair          (CP_BRZ, ...)    as the first instruction, target = branch target
+ *
+ * `handler` is what the fast engines dispatch on. It is the opcode itself
+ * unless the decoder recognised a pattern it has a specialised handler for,
+ * or ILLEGAL for any illegal opcode, see handlers.hpp; `opcode` always
+ * describes the instruction at this address.
+ * `cycles` is what it takes, see cycles.hpp.
+ */
+struct Instruction {
+    u8 opcode = NOP;
+    u8 handler = NOP;
+    u8 length = 1;
+    u8 cycles = 1;
+
+    u8 a = 0;
+    u8 b = 0;
+
+    u16 target = 0x0000;
+};
+
+Instruction decode(const std::array<u8, 0x10000>& program, u16 addr);
@@ -0,0 +1,303 @@
+#include <IoJournal.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include <Mcu.hpp>
+
+namespace {
+    void put_u8(std::ostream& out, u8 value) {
+        out.put(static_cast<char>(value));
+    }
+
+    void put_varint(std::ostream& out, u64 value) {
+        while (value >= 0x80) {
+            put_u8(out, static_cast<u8>(value | 0x80u));
+            value >>= 7u;
+        }
+        put_u8(out, static_cast<u8>(value));
+    }
+
+    u8 get_u8(std::istream& in) {
+        int c = in.get();
+        if (c == std::istream::traits_type::eof()) {
+            throw io_log_error { "I/O journal ends early" };
+        }
+        return static_cast<u8>(c);
+    }
+
+    u64 get_varint(std::istream& in) {
+        u64 value = 0;
+        for (u32 shift = 0; shift < 64; shift += 7) {
+            u8 byte = get_u8(in);
+            value |= u64 { byte & 0x7Fu } << shift;
+            if ((byte & 0x80u) == 0) {
+                return value;
+            }
+        }
+        throw io_log_error { "Malformed I/O journal" };
+    }
+}
+
+io_log_error::io_log_error(const std::string& what)
+    : std::runtime_error { what }
+{ }
+
+IoJournal::IoJournal(McuBase& mcu)
+    : mcu { mcu }
+{
+    this->saved.instructions = mcu.instructions;
+    this->saved.cycles = mcu.cycles;
+}
+
+void IoJournal::read(IoPorts& ports, u8 port, u8& value) {
+    if (this->replaying) {
+        if (this->cursor.inputs >= this->inputs_end()) {
+            throw io_log_error { "I/O journal has no more input to replay" };
+        }
+        value = this->input(this->cursor.inputs++);
+        this->replay_access();
+        return;
+    }
+
+    u8 pending = this->mcu.pending_interrupts();
+    if (IoHandler* handler = ports.find(port)) {
+        value = handler->get();
+    }
+
+    this->add_input(value, 1);
+    this->cursor.inputs++;
+    this->record_access(pending);
+}
+
+void IoJournal::write(IoPorts& ports, u8 port, u8 value) {
+    if (this->replaying) {
+        this->replay_access();
+        return;
+    }
+
+    u8 pending = this->mcu.pending_interrupts();
+    if (IoHandler* handler = ports.find(port)) {
+        handler->set(value);
+    }
+
+    this->record_access(pending);
+}
+
+u64 IoJournal::peek(IoPorts& ports, u8 port, u8& value) {
+    if (!this->replaying) {
+        IoHandler* handler = ports.find(port);
+        if (handler == nullptr) {
+            return UINT64_MAX;
+        }
+        if (!handler->pure) {
+            return 0;
+        }
+        value = handler->get();
+        return UINT64_MAX;
+    }
+
+    if (this->cursor.inputs >= this->inputs_end()) {
+        return 0;
+    }
+    value = this->input(this->cursor.inputs);
+    u64 reads = this->inputs[this->run].end - this->cursor.inputs;
+
+    u64 next = this->cursor.access_raises - this->base.access_raises;
+    if (next < this->access_raises.size()) {
+        reads = std::min(reads, this->access_raises[next].access - this->cursor.accesses);
+    }
+    return reads;
+}
+
+void IoJournal::skip(IoPorts&, u8, u8 value, u64 reads) {
+    if (!this->replaying) {
+        this->add_input(value, reads);
+    }
+    this->cursor.inputs += reads;
+    this->cursor.accesses += reads;
+}
+
+void IoJournal::add_input(u8 value, u64 count) {
+    if (!this->inputs.empty() && this->inputs.back().value == value) {
+        this->inputs.back().end += count;
+    }
+    else {
+        this->inputs.push_back(Input { this->inputs_end() + count, value });
+    }
+}
+
+u8 IoJournal::input(u64 index) {
+    /* Replay goes forward, so the input is mostly in the same run or the
+     * next one */
+    if (this->run < this->inputs.size() && this->inputs[this->run].end <= index) {
+        this->run++;
+    }
+    if (this->run >= this->inputs.size() || this->inputs[this->run].end <= index
+        || (this->run > 0 && this->inputs[this->run - 1].end > index)) {
+        auto it = std::upper_bound(this->inputs.begin(), this->inputs.end(), index, [](u64 index, const Input& input) {
+            return index < input.end;
+        });
+        this->run = static_cast<size_t>(it - this->inputs.begin());
+    }
+    return this->inputs[this->run].value;
+}
+
+void IoJournal::record_access(u8 pending_before) {
+    if (u8 raised = this->mcu.pending_interrupts() & ~pending_before) {
+        this->access_raises.push_back(AccessRaise { this->cursor.accesses, raised });
+        this->cursor.access_raises++;
+    }
+    this->cursor.accesses++;
+}
+
+void IoJournal::replay_access() {
+    u64 next = this->cursor.access_raises - this->base.access_raises;
+    if (next < this->access_raises.size() && this->access_raises[next].access == this->cursor.accesses) {
+        this->mcu.raise_interrupts(this->access_raises[next].mask);
+        this->cursor.access_raises++;
+    }
+    this->cursor.accesses++;
+}
+
+void IoJournal::record_host_raise(u8 mask) {
+    this->host_raises.push_back(HostRaise { this->mcu.cycles, mask });
+    this->cursor.host_raises++;
+}
+
+u64 IoJournal::replay_host_raises() {
+    while (this->cursor.host_raises - this->base.host_raises < this->host_raises.size()) {
+        const HostRaise& raise = this->host_raises[this->cursor.host_raises - this->base.host_raises];
+        if (raise.cycle > this->mcu.cycles) {
+            return raise.cycle;
+        }
+
+        this->mcu.raise_interrupts(raise.mask);
+        this->cursor.host_raises++;
+    }
+    return UINT64_MAX;
+}
+
+void IoJournal::seek(const Position& position) {
+    this->cursor = position;
+}
+
+void IoJournal::discard_before(const Position& position) {
+    while (!this->inputs.empty() && this->inputs.front().end <= position.inputs) {
+        this->inputs.pop_front();
+    }
+    this->run = 0;
+    this->access_raises.erase(this->access_raises.begin(), this->access_raises.begin() + (position.access_raises - this->base.access_raises));
+    this->host_raises.erase(this->host_raises.begin(), this->host_raises.begin() + (position.host_raises - this->base.host_raises));
+    this->base = position;
+}
+
+void IoJournal::save(std::ostream& out) {
+    put_varint(out, this->mcu.instructions - this->saved.instructions);
+    put_varint(out, this->mcu.cycles - this->saved.cycles);
+    put_varint(out, this->cursor.accesses - this->saved.end.accesses);
+
+    /* Runs too short to pay for a repeat are written out in full */
+    std::vector<u8> values;
+    std::vector<std::pair<u64, u64>> repeats;
+    for (u64 i = this->saved.end.inputs; i < this->cursor.inputs; ) {
+        u8 value = this->input(i);
+        u64 count = std::min(this->inputs[this->run].end, this->cursor.inputs) - i;
+        if (count >= 3) {
+            repeats.emplace_back(values.size(), count - 1);
+            values.push_back(value);
+        }
+        else {
+            values.insert(values.end(), count, value);
+        }
+        i += count;
+    }
+
+    put_varint(out, values.size());
+    for (u8 value : values) {
+        put_u8(out, value);
+    }
+
+    u64 value = 0;
+    put_varint(out, repeats.size());
+    for (auto [ index, further ] : repeats) {
+        put_varint(out, index - value);
+        put_varint(out, further);
+        value = index + 1;
+    }
+
+    u64 access = this->saved.end.accesses;
+    put_varint(out, this->cursor.access_raises - this->saved.end.access_raises);
+    for (u64 i = this->saved.end.access_raises; i < this->cursor.access_raises; i++) {
+        const AccessRaise& raise = this->access_raises[i - this->base.access_raises];
+        put_varint(out, raise.access - access);
+        put_u8(out, raise.mask);
+        access = raise.access;
+    }
+
+    u64 cycle = this->saved.cycles;
+    put_varint(out, this->cursor.host_raises - this->saved.end.host_raises);
+    for (u64 i = this->saved.end.host_raises; i < this->cursor.host_raises; i++) {
+        const HostRaise& raise = this->host_raises[i - this->base.host_raises];
+        put_varint(out, raise.cycle - cycle);
+        put_u8(out, raise.mask);
+        cycle = raise.cycle;
+    }
+
+    this->saved = Segment { this->cursor, this->mcu.instructions, this->mcu.cycles };
+}
+
+bool IoJournal::load(std::istream& in) {
+    if (in.peek() == std::istream::traits_type::eof()) {
+        return false;
+    }
+
+    Segment segment = this->saved;
+    segment.instructions += get_varint(in);
+    segment.cycles += get_varint(in);
+    segment.end.accesses += get_varint(in);
+
+    std::vector<u8> values;
+    for (u64 count = get_varint(in); count > 0; count--) {
+        values.push_back(get_u8(in));
+    }
+
+    /* Appended as they come, as repeats come in order */
+    u64 value = 0;
+    for (u64 count = get_varint(in); count > 0; count--) {
+        u64 index = value + get_varint(in);
+        u64 further = get_varint(in);
+        if (index >= values.size()) {
+            throw io_log_error { "Malformed I/O journal" };
+        }
+        for (; value < index; value++) {
+            this->add_input(values[value], 1);
+        }
+        this->add_input(values[value++], 1 + further);
+        segment.end.inputs += further;
+    }
+    for (; value < values.size(); value++) {
+        this->add_input(values[value], 1);
+    }
+    segment.end.inputs += values.size();
+
+    u64 access = this->saved.end.accesses;
+    for (u64 count = get_varint(in); count > 0; count--) {
+        access += get_varint(in);
+        this->access_raises.push_back(AccessRaise { access, get_u8(in) });
+        segment.end.access_raises++;
+    }
+
+    u64 cycle = this->saved.cycles;
+    for (u64 count = get_varint(in); count > 0; count--) {
+        cycle += get_varint(in);
+        this->host_raises.push_back(HostRaise { cycle, get_u8(in) });
+        segment.end.host_raises++;
+    }
+
+    this->saved = segment;
+    return true;
+}
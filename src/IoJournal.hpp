@@ -0,0 +1,150 @@
+#pragma once
+
+#include <deque>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+
+#include <IoPorts.hpp>
+#include <typedefs.hpp>
+
+class McuBase;
+
+/* Thrown when a journal is malformed or replay runs past its end */
+class io_log_error : public std::runtime_error {
+public:
+    explicit io_log_error(const std::string& what);
+};
+
+/* Everything a run takes from outside the program: the result of every IN
+ * and every interrupt raised by port handlers or by the host.
+ *
+ * While recording, port accesses go to the real handlers and the journal
+ * remembers what came back. While replaying, the recorded results are fed
+ * back without calling any handler. Interrupts raised by a handler are tied
+ * to the port access that raised them, interrupts raised by the host to the
+ * cycle they were raised at. A poll loop skipped by run() counts as a read
+ * per iteration, all giving the same result, and is kept as one run of
+ * inputs however long it spun.
+ *
+ * The records can be streamed out with save() and back in with load(), see
+ * IoRecorder and IoPlayer.
+ */
+class IoJournal : public IoTap {
+public:
+    /* Where in the journal a run is, see seek() */
+    struct Position {
+        u64 inputs = 0;
+        u64 access_raises = 0;
+        u64 host_raises = 0;
+        u64 accesses = 0;
+    };
+
+    /* Where the last save() stopped or the last load() got to */
+    struct Segment {
+        Position end;
+        u64 instructions = 0;
+        u64 cycles = 0;
+    };
+
+    explicit IoJournal(McuBase& mcu);
+
+    bool replaying = false;
+
+    void read(IoPorts& ports, u8 port, u8& value) override;
+    void write(IoPorts& ports, u8 port, u8 value) override;
+
+    /* While replaying, as far as the recorded inputs stay the same and no
+     * access raised anything */
+    u64 peek(IoPorts& ports, u8 port, u8& value) override;
+    void skip(IoPorts& ports, u8 port, u8 value, u64 reads) override;
+
+    /* Records interrupts (see McuBase::pending_interrupts()) the host raised
+     * at the current cycle */
+    void record_host_raise(u8 mask);
+
+    /* Raises the recorded host interrupts due by the current cycle, returns
+     * the cycle of the next one or UINT64_MAX */
+    u64 replay_host_raises();
+
+    Position position() const {
+        return this->cursor;
+    }
+
+    /* Continues recording or replaying from `position` */
+    void seek(const Position& position);
+
+    /* Forgets everything before `position` */
+    void discard_before(const Position& position);
+
+    /* Writes what was recorded since the last save() to `out` as a segment:
+     *
+     *   varint instructions, cycles and port accesses since the last save()
+     *   varint count, u8 result of each IN, once for a run of three or more
+     *          alike
+     *   varint count, varint results since the previous run (or the first
+     *          result), varint further INs giving the result of each run
+     *   varint count, varint accesses since the previous one (or the last
+     *          save()), u8 mask of each interrupt raised by a port access
+     *   varint count, varint cycles since the previous one (or the last
+     *          save()), u8 mask of each interrupt raised by the host
+     *
+     * Varints are LEB128, so an IN takes a byte, a skipped poll loop a few
+     * and a raise two in the common case. Everything saved can be discarded
+     * afterwards. */
+    void save(std::ostream& out);
+
+    /* Appends the next segment from `in` to replay. Returns false at the end
+     * of the stream, throws io_log_error if the segment is cut short. */
+    bool load(std::istream& in);
+
+    Segment segment() const {
+        return this->saved;
+    }
+
+private:
+    /* Inputs alike up to input `end` (exclusive), from the end of the run
+     * before */
+    struct Input {
+        u64 end;
+        u8 value;
+    };
+
+    struct AccessRaise {
+        u64 access;
+        u8 mask;
+    };
+
+    struct HostRaise {
+        u64 cycle;
+        u8 mask;
+    };
+
+    void record_access(u8 pending_before);
+    void replay_access();
+
+    void add_input(u8 value, u64 count);
+
+    /* Result of input `index`, which must be kept */
+    u8 input(u64 index);
+
+    u64 inputs_end() const {
+        return this->inputs.empty() ? this->base.inputs : this->inputs.back().end;
+    }
+
+    McuBase& mcu;
+
+    std::deque<Input> inputs;
+
+    /* Run the last input() came from */
+    size_t run = 0;
+
+    std::deque<AccessRaise> access_raises;
+    std::deque<HostRaise> host_raises;
+
+    /* Position of the first entry still kept */
+    Position base;
+    Position cursor;
+
+    Segment saved;
+};
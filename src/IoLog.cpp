@@ -0,0 +1,217 @@
+#include <IoLog.hpp>
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+
+#include <fmt/format.h>
+
+namespace {
+    constexpr char magic[4] = { 'M', 'C', 'U', 'L' };
+
+    void put_u8(std::ostream& out, u8 value) {
+        out.put(static_cast<char>(value));
+    }
+
+    void put_u64(std::ostream& out, u64 value) {
+        for (u32 i = 0; i < 8; i++) {
+            put_u8(out, static_cast<u8>(value >> (i * 8u)));
+        }
+    }
+
+    u8 get_u8(std::istream& in) {
+        int c = in.get();
+        if (c == std::istream::traits_type::eof()) {
+            throw io_log_error { "I/O log ends early" };
+        }
+        return static_cast<u8>(c);
+    }
+
+    u64 get_u64(std::istream& in) {
+        u64 value = 0;
+        for (u32 i = 0; i < 8; i++) {
+            value |= u64 { get_u8(in) } << (i * 8u);
+        }
+        return value;
+    }
+}
+
+IoRecorder::IoRecorder(Mcu& mcu, std::ostream& out)
+    : Attachment { mcu }
+    , mcu { mcu }
+    , out { out }
+    , journal { mcu }
+    , seen { mcu.pending_interrupts() }
+{
+    this->out.write(magic, sizeof(magic));
+    put_u8(this->out, static_cast<u8>(IoRecorder::version & 0xFFu));
+    put_u8(this->out, static_cast<u8>(IoRecorder::version >> 8u));
+    put_u64(this->out, this->mcu.instructions);
+    put_u64(this->out, this->mcu.cycles);
+
+    this->mcu.tap = &this->journal;
+    this->mcu.hold_requests = true;
+    this->mcu.hold_events = true;
+}
+
+IoRecorder::~IoRecorder() {
+    this->mcu.tap = nullptr;
+    this->mcu.hold_requests = false;
+    this->mcu.hold_events = false;
+    this->mcu.raise_interrupts(this->mcu.release_requests());
+    this->out.flush();
+}
+
+Mcu::RunResult IoRecorder::run(u64 budget) {
+    const u64 start_cycles = this->mcu.cycles;
+    const u64 start_instructions = this->mcu.instructions;
+    const u64 deadline = this->mcu.cycles + std::min(budget, UINT64_MAX - this->mcu.cycles);
+
+    if (u8 raised = this->mcu.pending_interrupts() & ~this->seen) {
+        this->journal.record_host_raise(raised);
+    }
+
+    Mcu::StopReason reason = Mcu::StopReason::Budget;
+
+    while (this->mcu.cycles < deadline) {
+        /* Take requests from other threads and run device events here
+         * rather than in Mcu::run(), which returns whenever one is due, to
+         * see what they raise */
+        u8 pending = this->mcu.pending_interrupts();
+        this->mcu.raise_interrupts(this->mcu.release_requests());
+        this->mcu.scheduler.run_due(this->mcu.cycles);
+        if (u8 raised = this->mcu.pending_interrupts() & ~pending) {
+            this->journal.record_host_raise(raised);
+        }
+
+        u64 limit = std::min(deadline, this->mcu.scheduler.next_deadline());
+
+        auto result = this->mcu.run(limit - this->mcu.cycles);
+        if (result.reason != Mcu::StopReason::Budget) {
+            reason = result.reason;
+            break;
+        }
+    }
+
+    this->seen = this->mcu.pending_interrupts();
+
+    this->journal.save(this->out);
+    this->journal.discard_before(this->journal.position());
+
+    return Mcu::RunResult {
+        .instructions = this->mcu.instructions - start_instructions,
+        .cycles = this->mcu.cycles - start_cycles,
+        .reason = reason,
+    };
+}
+
+void IoRecorder::leave(McuBase& fork) const {
+    /* Attached to an Mcu, so its forks are Mcus too */
+    Mcu& copy = static_cast<Mcu&>(fork);
+
+    copy.tap = nullptr;
+    copy.hold_requests = false;
+    copy.hold_events = false;
+    copy.raise_interrupts(copy.release_requests());
+}
+
+IoPlayer::IoPlayer(Mcu& mcu, std::istream& in)
+    : Attachment { mcu }
+    , mcu { mcu }
+    , in { in }
+    , journal { mcu }
+{
+    char found[sizeof(magic)] = {};
+    if (!this->in.read(found, sizeof(found)) || !std::equal(found, found + sizeof(found), magic)) {
+        throw io_log_error { "Not an I/O log" };
+    }
+
+    u16 version = get_u8(this->in);
+    version |= static_cast<u16>(get_u8(this->in) << 8u);
+    if (version != IoRecorder::version) {
+        throw io_log_error { fmt::format("Unsupported I/O log version {}", version) };
+    }
+
+    u64 instructions = get_u64(this->in);
+    u64 cycles = get_u64(this->in);
+    if (instructions != mcu.instructions || cycles != mcu.cycles) {
+        throw io_log_error { fmt::format("I/O log starts at instruction {}, not {}", instructions, mcu.instructions) };
+    }
+
+    this->journal.replaying = true;
+
+    this->mcu.tap = &this->journal;
+    this->mcu.hold_requests = true;
+}
+
+IoPlayer::~IoPlayer() {
+    this->mcu.tap = nullptr;
+    this->mcu.hold_requests = false;
+    this->mcu.raise_interrupts(this->mcu.release_requests());
+}
+
+Mcu::RunResult IoPlayer::run(u64 budget) {
+    const u64 start_cycles = this->mcu.cycles;
+    const u64 start_instructions = this->mcu.instructions;
+    const u64 deadline = this->mcu.cycles + std::min(budget, UINT64_MAX - this->mcu.cycles);
+
+    Mcu::StopReason reason = Mcu::StopReason::Budget;
+
+    this->check();
+
+    while (this->mcu.cycles < deadline) {
+        u64 limit = std::min(deadline, this->journal.replay_host_raises());
+        if (!this->loaded) {
+            limit = std::min(limit, this->journal.segment().cycles);
+        }
+
+        auto result = this->mcu.run(limit - this->mcu.cycles);
+        this->check();
+
+        if (result.reason != Mcu::StopReason::Budget) {
+            reason = result.reason;
+            break;
+        }
+    }
+
+    this->journal.discard_before(this->journal.position());
+
+    return Mcu::RunResult {
+        .instructions = this->mcu.instructions - start_instructions,
+        .cycles = this->mcu.cycles - start_cycles,
+        .reason = reason,
+    };
+}
+
+bool IoPlayer::finished() {
+    this->check();
+
+    IoJournal::Position position = this->journal.position();
+    IoJournal::Segment segment = this->journal.segment();
+    return position.inputs == segment.end.inputs
+        && position.access_raises == segment.end.access_raises
+        && position.host_raises == segment.end.host_raises
+        && this->in.peek() == std::istream::traits_type::eof();
+}
+
+void IoPlayer::leave(McuBase& fork) const {
+    /* Attached to an Mcu, so its forks are Mcus too */
+    Mcu& copy = static_cast<Mcu&>(fork);
+
+    copy.tap = nullptr;
+    copy.hold_requests = false;
+    copy.raise_interrupts(copy.release_requests());
+}
+
+void IoPlayer::check() {
+    /* Runs stop at the end of each segment, where the recording run did, so
+     * a replay that strays is caught there */
+    while (!this->loaded && this->mcu.cycles >= this->journal.segment().cycles) {
+        IoJournal::Segment segment = this->journal.segment();
+        if (this->mcu.cycles != segment.cycles || this->mcu.instructions != segment.instructions
+            || this->journal.position().accesses != segment.end.accesses) {
+            throw io_log_error { fmt::format("Replay does not match the I/O log at instruction {}", this->mcu.instructions) };
+        }
+        this->loaded = !this->journal.load(this->in);
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <iosfwd>
+
+#include <Attachment.hpp>
+#include <IoJournal.hpp>
+#include <Mcu.hpp>
+#include <typedefs.hpp>
+
+/* IoRecorder writes and IoPlayer reads an append-only binary log of
+ * everything a run takes from outside the program, to reproduce it later
+ * without the host's devices. The log is an IoJournal streamed out:
+ *
+ *   header    "MCUL", u16 version, u64 instructions, u64 cycles
+ *   segments  one per IoRecorder::run(), see IoJournal::save()
+ *
+ * Only one tap can be attached at a time, so recording does not mix with
+ * TimeTravel.
+ */
+
+/* Records a session of `mcu` to `out`. Runs must go through run() so
+ * interrupts the host raises between them, scheduled device events raise
+ * and other threads request are seen, interrupts raised by port handlers
+ * are seen as they happen. */
+class IoRecorder : public Attachment {
+public:
+    static constexpr u16 version = 3;
+
+    IoRecorder(Mcu& mcu, std::ostream& out);
+    ~IoRecorder() override;
+
+    IoRecorder(const IoRecorder&) = delete;
+    IoRecorder& operator=(const IoRecorder&) = delete;
+
+    Mcu::RunResult run(u64 budget);
+
+    /* Forks run unrecorded */
+    void leave(McuBase& fork) const override;
+
+private:
+    Mcu& mcu;
+    std::ostream& out;
+    IoJournal journal;
+
+    /* Pending interrupts after the last run, to tell what the host raised */
+    u8 seen;
+};
+
+/* Replays a log from `in` on `mcu`, which must be in the state recording
+ * started from, with no device events scheduled. IN results and interrupts
+ * come from the log, no handler is called and OUT goes nowhere. Requests
+ * from other threads are held until the player goes away.
+ *
+ * Throws io_log_error if the log is malformed, was recorded from another
+ * point or the run stops matching it: every segment has to end at the same
+ * instruction, cycle and port access as the recording run did. */
+class IoPlayer : public Attachment {
+public:
+    IoPlayer(Mcu& mcu, std::istream& in);
+    ~IoPlayer() override;
+
+    IoPlayer(const IoPlayer&) = delete;
+    IoPlayer& operator=(const IoPlayer&) = delete;
+
+    Mcu::RunResult run(u64 budget);
+
+    /* Whether every record has been replayed, throws io_log_error if the
+     * replay has strayed from it */
+    bool finished();
+
+    /* Forks run live, with the handlers left on the bus */
+    void leave(McuBase& fork) const override;
+
+private:
+    /* Checks the replay against the end of every segment it has reached,
+     * loading the next one, and throws io_log_error where they differ */
+    void check();
+
+    Mcu& mcu;
+    std::istream& in;
+    IoJournal journal;
+
+    /* Whether the last segment has been loaded */
+    bool loaded = false;
+};
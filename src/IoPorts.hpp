@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <functional>
+
+#include <typedefs.hpp>
+
+struct IoHandler {
+    std::function<u8()> get = []() { return 0x00; };
+    std::function<void(u8)> set = [](u8) { };
+
+    /* `get` has no side effects and keeps returning the same value until the
+     * host changes something, which lets run() skip loops polling the port */
+    bool pure = false;
+};
+
+class IoPorts;
+
+/* Sits between a bus and its handlers to see every port access, see
+ * DynamicBus::tap */
+class IoTap {
+public:
+    virtual ~IoTap() = default;
+
+    virtual void read(IoPorts& ports, u8 port, u8& value) = 0;
+    virtual void write(IoPorts& ports, u8 port, u8 value) = 0;
+
+    /* How many reads of `port` in a row would all give the same value and do
+     * nothing else, setting `value` to it, or zero. Lets run() skip loops
+     * polling the port. */
+    virtual u64 peek(IoPorts& ports, u8 port, u8& value) = 0;
+
+    /* Stands for `reads` such reads of `port` giving `value` */
+    virtual void skip(IoPorts& ports, u8 port, u8 value, u64 reads) = 0;
+};
+
+/* Handlers for the 256 I/O ports, indexed directly by port number.
+ *
+ * Behaves like the map it replaces: `ports[port]` maps the port with default
+ * handlers if needed, reading an unmapped port leaves the register unchanged
+ * and writing one does nothing.
+ */
+class IoPorts {
+public:
+    IoHandler& operator[](u8 port) {
+        this->mapped.set(port);
+        return this->handlers[port];
+    }
+
+    /* Handler for `port`, or nullptr if it is unmapped */
+    IoHandler* find(u8 port) {
+        return this->mapped.test(port) ? &this->handlers[port] : nullptr;
+    }
+
+    const IoHandler* find(u8 port) const {
+        return this->mapped.test(port) ? &this->handlers[port] : nullptr;
+    }
+
+    bool contains(u8 port) const {
+        return this->mapped.test(port);
+    }
+
+    void erase(u8 port) {
+        this->mapped.reset(port);
+        this->handlers[port] = {};
+    }
+
+    void clear() {
+        this->mapped.reset();
+        this->handlers = {};
+    }
+
+private:
+    std::bitset<0x100> mapped;
+    std::array<IoHandler, 0x100> handlers {};
+};
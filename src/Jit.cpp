@@ -0,0 +1,645 @@
+#include <Jit.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+
+#if MCU_JIT_AVAILABLE
+#   include <sys/mman.h>
+#endif
+
+#include <Mcu.hpp>
+#include <cycles.hpp>
+#include <handlers.hpp>
+#include <opcodes.hpp>
+#include <util.hpp>
+
+namespace {
+    constexpr size_t code_capacity = 4u << 20u;
+    constexpr u32 max_block_instructions = 64;
+
+    /* Generous upper bound on the code generated for one block, including
+     * the calls out of line for writes to clean pages */
+    constexpr size_t max_block_size = 64 + max_block_instructions * 192 + 4 * 32;
+
+    /* Host registers used as scratch, rbx holds the Mcu, r12 the cycle budget */
+    constexpr u8 EAX = 0;
+    constexpr u8 ECX = 1;
+    constexpr u8 EDX = 2;
+    constexpr u8 ESI = 6;
+    constexpr u8 EDI = 7;
+
+    class Emitter {
+    public:
+        explicit Emitter(u8* cursor)
+            : cursor { cursor }
+        { }
+
+        u8* position() const {
+            return this->cursor;
+        }
+
+        void bytes(std::initializer_list<u8> bytes) {
+            for (u8 byte : bytes) {
+                *this->cursor++ = byte;
+            }
+        }
+
+        void imm8(u8 value) {
+            this->bytes({ value });
+        }
+
+        void imm16(u16 value) {
+            this->bytes({ low_byte(value), high_byte(value) });
+        }
+
+        void imm32(u32 value) {
+            this->imm16(static_cast<u16>(value & 0xFFFFu));
+            this->imm16(static_cast<u16>(value >> 16u));
+        }
+
+        void imm64(u64 value) {
+            this->imm32(static_cast<u32>(value & 0xFFFFFFFFu));
+            this->imm32(static_cast<u32>(value >> 32u));
+        }
+
+        /* `op reg, [rbx + disp]` */
+        void rbx(std::initializer_list<u8> op, u8 reg, i32 disp) {
+            this->bytes(op);
+            this->imm8(static_cast<u8>(0x80u | reg << 3u | 0x03u));
+            this->imm32(static_cast<u32>(disp));
+        }
+
+        /* `op reg, [rbx + index * 8 + disp]` */
+        void rbx_index(std::initializer_list<u8> op, u8 reg, u8 index, i32 disp) {
+            this->bytes(op);
+            this->imm8(static_cast<u8>(0x80u | reg << 3u | 0x04u));
+            this->imm8(static_cast<u8>(0xC0u | index << 3u | 0x03u));
+            this->imm32(static_cast<u32>(disp));
+        }
+
+        /* Jump with a rel32 operand to be filled in later, returns the operand */
+        u8* jump(std::initializer_list<u8> op) {
+            this->bytes(op);
+            u8* site = this->cursor;
+            this->imm32(0);
+            return site;
+        }
+
+    private:
+        u8* cursor;
+    };
+
+    void patch(u8* site, const u8* target) {
+        auto rel = static_cast<i32>(target - (site + 4));
+        std::memcpy(site, &rel, sizeof(rel));
+    }
+
+    /* Called by translated code for writes to clean pages */
+    void write_memory(McuBase* mcu, u32 addr, u32 value) {
+        mcu->memory.write(static_cast<u16>(addr), static_cast<u8>(value));
+    }
+
+    bool ends_block(u8 opcode) {
+        switch (opcode) {
+            case JMP:
+            case CALL:
+            case RET:
+            case BRC:
+            case BRNC:
+            case BRZ:
+            case BRNZ: {
+                return true;
+            }
+            default: {
+                return false;
+            }
+        }
+    }
+}
+
+Jit::Jit(const McuBase& mcu)
+    : blocks(0x10000, nullptr)
+{
+    auto offset = [&mcu](const auto& field) {
+        return static_cast<i32>(reinterpret_cast<const u8*>(&field) - reinterpret_cast<const u8*>(&mcu));
+    };
+
+    this->layout = Layout {
+        .pc = offset(mcu.pc),
+        .sp = offset(mcu.sp),
+        .registers = offset(mcu.registers),
+        .carry = offset(mcu.flags.carry),
+        .zero = offset(mcu.flags.zero),
+        .interrupt = offset(mcu.flags.interrupt),
+        .pages = offset(mcu.memory.page_table()),
+        .dirty = offset(mcu.memory.dirty_pages()),
+        .instructions = offset(mcu.instructions),
+        .program = offset(mcu.program),
+        .requests = offset(mcu.requests),
+    };
+
+#if MCU_JIT_AVAILABLE
+    void* memory = mmap(nullptr, code_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return;
+    }
+
+    this->code = static_cast<u8*>(memory);
+    this->capacity = code_capacity;
+
+    Emitter e { this->code };
+
+    /* entry(mcu, cycles, block) */
+    e.bytes({ 0x53 });                  // push rbx
+    e.bytes({ 0x41, 0x54 });            // push r12
+    e.bytes({ 0x48, 0x89, 0xFB });      // mov rbx, rdi
+    e.bytes({ 0x49, 0x89, 0xF4 });      // mov r12, rsi
+    e.bytes({ 0xFF, 0xE2 });            // jmp rdx
+
+    this->exit = e.position();
+    e.bytes({ 0x41, 0x5C });            // pop r12
+    e.bytes({ 0x5B });                  // pop rbx
+    e.bytes({ 0xC3 });                  // ret
+
+    this->entry = reinterpret_cast<Entry>(this->code);
+    this->trampoline_size = static_cast<size_t>(e.position() - this->code);
+    this->used = this->trampoline_size;
+
+    this->protect(false);
+#endif
+}
+
+Jit::~Jit() {
+#if MCU_JIT_AVAILABLE
+    if (this->code != nullptr) {
+        munmap(this->code, this->capacity);
+    }
+#endif
+}
+
+bool Jit::run(McuBase& mcu, u64& cycles) {
+    if (this->code == nullptr) {
+        return false;
+    }
+
+    const u8* block = this->blocks[mcu.pc];
+    if (block == nullptr) {
+        if (!translatable(mcu.decoded[mcu.pc])) {
+            return false;
+        }
+        block = this->compile(mcu, mcu.pc);
+        if (block == nullptr) {
+            return false;
+        }
+    }
+
+    this->entry(&mcu, &cycles, block);
+    return true;
+}
+
+bool Jit::translatable(const Instruction& insn) {
+    /* Idle loops are skipped by the host loop, fused pairs are translated as
+     * their two halves */
+    if (insn.handler == IDLE_LOOP) {
+        return false;
+    }
+
+    switch (insn.opcode) {
+        case NOP:
+        case SEC:
+        case SEZ:
+        case CLI:
+        case CLC:
+        case CLZ:
+        case ADD:
+        case ADC:
+        case SUB:
+        case SBC:
+        case INC:
+        case DEC:
+        case AND:
+        case OR:
+        case XOR:
+        case CP:
+        case CPI:
+        case JMP:
+        case CALL:
+        case RET:
+        case BRC:
+        case BRNC:
+        case BRZ:
+        case BRNZ:
+        case MOV:
+        case LDI:
+        case LD:
+        case ST:
+        case PUSH:
+        case POP:
+        case LPM: {
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+const u8* Jit::compile(const McuBase& mcu, u16 addr) {
+    if (!this->protect(true)) {
+        return nullptr;
+    }
+
+    if (this->capacity - this->used < max_block_size) {
+        this->flush();
+    }
+
+    /* Find the extent of the block */
+    u32 count = 0;
+    u32 cost = 0;
+    for (u16 pc = addr; count < max_block_instructions; ) {
+        const Instruction& insn = mcu.decoded[pc];
+        if (!translatable(insn)) {
+            break;
+        }
+
+        count++;
+        cost += insn.cycles;
+        pc += insn.length;
+
+        if (ends_block(insn.opcode)) {
+            break;
+        }
+    }
+
+    u8* start = this->code + this->used;
+    Emitter e { start };
+
+    const Layout& l = this->layout;
+    auto reg = [&l](u8 r) {
+        return l.registers + r;
+    };
+    auto store_flags = [&e, &l]() {
+        e.rbx({ 0x0F, 0x92 }, 0, l.carry);              // setc [carry]
+        e.rbx({ 0x0F, 0x94 }, 0, l.zero);               // setz [zero]
+    };
+    auto load_carry = [&e, &l]() {
+        e.rbx({ 0x8A }, ECX, l.carry);                  // mov cl, [carry]
+        e.bytes({ 0x80, 0xC1, 0xFF });                  // add cl, 0xFF
+    };
+    auto load_address = [&e, &reg](u8 high, u8 low) {
+        e.rbx({ 0x0F, 0xB6 }, EAX, reg(high));          // movzx eax, [high]
+        e.bytes({ 0xC1, 0xE0, 0x08 });                  // shl eax, 8
+        e.rbx({ 0x8A }, EAX, reg(low));                 // mov al, [low]
+    };
+
+    /* Loads the byte at the address in eax into `dst`, zero extended */
+    auto read = [&e, &l](u8 dst) {
+        e.bytes({ 0x89, 0xC2 });                        // mov edx, eax
+        e.bytes({ 0xC1, 0xEA, 0x08 });                  // shr edx, 8
+        e.rbx_index({ 0x48, 0x8B }, EDX, EDX, l.pages); // mov rdx, [pages + rdx * 8]
+        e.bytes({ 0x0F, 0xB6, 0xF0 });                  // movzx esi, al
+        e.bytes({ 0x0F, 0xB6, static_cast<u8>(dst << 3u | 0x04u), 0x32 }); // movzx dst, byte [rdx + rsi]
+    };
+
+    /* Writes to clean pages, which go through write_memory() out of line */
+    struct Claim {
+        u8* site;
+        u8* resume;
+        bool immediate;
+        u8 value;
+    };
+    std::vector<Claim> claims;
+
+    /* Stores cl, or `value` if `immediate`, at the address in eax */
+    auto write = [&e, &l, &claims](bool immediate, u8 value) {
+        e.bytes({ 0x89, 0xC6 });                        // mov esi, eax
+        e.bytes({ 0xC1, 0xEE, 0x08 });                  // shr esi, 8
+        e.bytes({ 0x89, 0xF2 });                        // mov edx, esi
+        e.bytes({ 0xC1, 0xEA, 0x06 });                  // shr edx, 6
+        e.rbx_index({ 0x48, 0x8B }, EDX, EDX, l.dirty); // mov rdx, [dirty + rdx * 8]
+        e.bytes({ 0x48, 0x0F, 0xA3, 0xF2 });            // bt rdx, rsi
+        u8* site = e.jump({ 0x0F, 0x83 });              // jnc claim
+        e.rbx_index({ 0x48, 0x8B }, EDX, ESI, l.pages); // mov rdx, [pages + rsi * 8]
+        e.bytes({ 0x0F, 0xB6, 0xF0 });                  // movzx esi, al
+        if (immediate) {
+            e.bytes({ 0xC6, 0x04, 0x32, value });       // mov byte [rdx + rsi], imm8
+        }
+        else {
+            e.bytes({ 0x88, 0x0C, 0x32 });              // mov [rdx + rsi], cl
+        }
+        claims.push_back({ site, e.position(), immediate, value });
+    };
+
+    /* Leave for the host to take requests from other threads */
+    e.rbx({ 0x80 }, 7, l.requests);                     // cmp byte [requests], 0
+    e.imm8(0);
+    u8* requested = e.jump({ 0x0F, 0x85 });             // jne bail
+
+    /* Charge the whole block up front, leave if the budget can't cover it
+     * with the branch at its end taken, which costs extra */
+    e.bytes({ 0x49, 0x81, 0x3C, 0x24 });                // cmp qword [r12], cost + taken
+    e.imm32(cost + BRANCH_TAKEN_CYCLES);
+    u8* bail = e.jump({ 0x0F, 0x82 });                  // jb bail
+    e.bytes({ 0x49, 0x81, 0x2C, 0x24 });                // sub qword [r12], cost
+    e.imm32(cost);
+    e.rbx({ 0x48, 0x81 }, 0, l.instructions);           // add qword [instructions], count
+    e.imm32(count);
+
+    struct Exit {
+        u8* site;
+        u16 target;
+    };
+    std::vector<Exit> exits;
+
+    u16 pc = addr;
+    u8 last = NOP;
+    for (u32 i = 0; i < count; i++) {
+        const Instruction& insn = mcu.decoded[pc];
+        u16 next = pc + insn.length;
+        last = insn.opcode;
+
+        switch (insn.opcode) {
+            case NOP: {
+                break;
+            }
+            case SEC:
+            case CLC: {
+                e.rbx({ 0xC6 }, 0, l.carry);            // mov byte [carry], imm8
+                e.imm8(insn.opcode == SEC);
+                break;
+            }
+            case SEZ:
+            case CLZ: {
+                e.rbx({ 0xC6 }, 0, l.zero);             // mov byte [zero], imm8
+                e.imm8(insn.opcode == SEZ);
+                break;
+            }
+            case CLI: {
+                e.rbx({ 0xC6 }, 0, l.interrupt);        // mov byte [interrupt], 0
+                e.imm8(0);
+                break;
+            }
+            case ADD: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                e.rbx({ 0x00 }, EAX, reg(insn.a));      // add [dst], al
+                store_flags();
+                break;
+            }
+            case ADC: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                load_carry();
+                e.rbx({ 0x10 }, EAX, reg(insn.a));      // adc [dst], al
+                store_flags();
+                break;
+            }
+            case SUB: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                e.rbx({ 0x28 }, EAX, reg(insn.a));      // sub [dst], al
+                store_flags();
+                break;
+            }
+            case SBC: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                load_carry();
+                e.rbx({ 0x18 }, EAX, reg(insn.a));      // sbb [dst], al
+                store_flags();
+                break;
+            }
+            case INC: {
+                e.rbx({ 0x80 }, 0, reg(insn.a));        // add byte [dst], 1
+                e.imm8(1);
+                store_flags();
+                break;
+            }
+            case DEC: {
+                e.rbx({ 0x80 }, 5, reg(insn.a));        // sub byte [dst], 1
+                e.imm8(1);
+                store_flags();
+                break;
+            }
+            case AND: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                e.rbx({ 0x20 }, EAX, reg(insn.a));      // and [dst], al
+                store_flags();
+                break;
+            }
+            case OR: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                e.rbx({ 0x08 }, EAX, reg(insn.a));      // or [dst], al
+                store_flags();
+                break;
+            }
+            case XOR: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                e.rbx({ 0x30 }, EAX, reg(insn.a));      // xor [dst], al
+                store_flags();
+                break;
+            }
+            case CP: {
+                e.rbx({ 0x8A }, EAX, reg(insn.a));      // mov al, [r0]
+                e.rbx({ 0x3A }, EAX, reg(insn.b));      // cmp al, [r1]
+                store_flags();
+                break;
+            }
+            case CPI: {
+                e.rbx({ 0x80 }, 7, reg(insn.a));        // cmp byte [reg], imm8
+                e.imm8(insn.b);
+                store_flags();
+                break;
+            }
+            case MOV: {
+                e.rbx({ 0x8A }, EAX, reg(insn.b));      // mov al, [src]
+                e.rbx({ 0x88 }, EAX, reg(insn.a));      // mov [dst], al
+                break;
+            }
+            case LDI: {
+                e.rbx({ 0xC6 }, 0, reg(insn.a));        // mov byte [dst], imm8
+                e.imm8(insn.b);
+                break;
+            }
+            case LD:
+            case LPM: {
+                load_address(14, 15);
+                if (insn.opcode == LD) {
+                    read(ECX);
+                }
+                else {
+                    e.rbx({ 0x48, 0x8B }, EDX, l.program); // mov rdx, [program]
+                    e.bytes({ 0x8A, 0x0C, 0x02 });      // mov cl, [rdx + rax]
+                }
+                e.rbx({ 0x88 }, ECX, reg(insn.a));      // mov [dst], cl
+                break;
+            }
+            case ST: {
+                load_address(12, 13);
+                e.rbx({ 0x8A }, ECX, reg(insn.a));      // mov cl, [src]
+                write(false, 0);
+                break;
+            }
+            case PUSH: {
+                e.rbx({ 0x0F, 0xB7 }, EAX, l.sp);       // movzx eax, word [sp]
+                e.rbx({ 0x8A }, ECX, reg(insn.a));      // mov cl, [src]
+                write(false, 0);
+                e.bytes({ 0xFF, 0xC8 });                // dec eax
+                e.rbx({ 0x66, 0x89 }, EAX, l.sp);       // mov [sp], ax
+                break;
+            }
+            case POP: {
+                e.rbx({ 0x0F, 0xB7 }, EAX, l.sp);       // movzx eax, word [sp]
+                e.bytes({ 0xFF, 0xC0 });                // inc eax
+                e.rbx({ 0x66, 0x89 }, EAX, l.sp);       // mov [sp], ax
+                e.bytes({ 0x0F, 0xB7, 0xC0 });          // movzx eax, ax
+                read(ECX);
+                e.rbx({ 0x88 }, ECX, reg(insn.a));      // mov [dst], cl
+                break;
+            }
+            case JMP: {
+                exits.push_back({ e.jump({ 0xE9 }), insn.target });
+                break;
+            }
+            case CALL: {
+                e.rbx({ 0x0F, 0xB7 }, EAX, l.sp);       // movzx eax, word [sp]
+                write(true, high_byte(next));
+                e.bytes({ 0xFF, 0xC8 });                // dec eax
+                e.bytes({ 0x0F, 0xB7, 0xC0 });          // movzx eax, ax
+                write(true, low_byte(next));
+                e.bytes({ 0xFF, 0xC8 });                // dec eax
+                e.rbx({ 0x66, 0x89 }, EAX, l.sp);       // mov [sp], ax
+                exits.push_back({ e.jump({ 0xE9 }), insn.target });
+                break;
+            }
+            case RET: {
+                e.rbx({ 0x0F, 0xB7 }, EAX, l.sp);       // movzx eax, word [sp]
+                e.bytes({ 0xFF, 0xC0 });                // inc eax
+                e.bytes({ 0x0F, 0xB7, 0xC0 });          // movzx eax, ax
+                read(ECX);
+                e.bytes({ 0xFF, 0xC0 });                // inc eax
+                e.bytes({ 0x0F, 0xB7, 0xC0 });          // movzx eax, ax
+                read(EDI);
+                e.rbx({ 0x66, 0x89 }, EAX, l.sp);       // mov [sp], ax
+                e.bytes({ 0xC1, 0xE7, 0x08 });          // shl edi, 8
+                e.bytes({ 0x09, 0xF9 });                // or ecx, edi
+                e.rbx({ 0x66, 0x89 }, ECX, l.pc);       // mov [pc], cx
+
+                /* Continue in the target block if there is one */
+                e.bytes({ 0x48, 0xBA });                // mov rdx, blocks
+                e.imm64(reinterpret_cast<u64>(this->blocks.data()));
+                e.bytes({ 0x48, 0x8B, 0x14, 0xCA });    // mov rdx, [rdx + rcx * 8]
+                e.bytes({ 0x48, 0x85, 0xD2 });          // test rdx, rdx
+                patch(e.jump({ 0x0F, 0x84 }), this->exit); // jz exit
+                e.bytes({ 0xFF, 0xE2 });                // jmp rdx
+                break;
+            }
+            case BRC:
+            case BRNC: {
+                e.rbx({ 0x80 }, 7, l.carry);            // cmp byte [carry], 0
+                e.imm8(0);
+                exits.push_back({ e.jump({ 0x0F, static_cast<u8>(insn.opcode == BRC ? 0x84 : 0x85) }), next });
+                e.bytes({ 0x49, 0x83, 0x2C, 0x24, BRANCH_TAKEN_CYCLES }); // sub qword [r12], taken
+                exits.push_back({ e.jump({ 0xE9 }), insn.target });
+                break;
+            }
+            case BRZ:
+            case BRNZ: {
+                e.rbx({ 0x80 }, 7, l.zero);             // cmp byte [zero], 0
+                e.imm8(0);
+                exits.push_back({ e.jump({ 0x0F, static_cast<u8>(insn.opcode == BRZ ? 0x84 : 0x85) }), next });
+                e.bytes({ 0x49, 0x83, 0x2C, 0x24, BRANCH_TAKEN_CYCLES }); // sub qword [r12], taken
+                exits.push_back({ e.jump({ 0xE9 }), insn.target });
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+
+        pc = next;
+    }
+
+    if (!ends_block(last)) {
+        /* Ran into an untranslatable instruction or the length limit */
+        exits.push_back({ e.jump({ 0xE9 }), pc });
+    }
+
+    /* Exit stubs: record where execution stopped and return to the host */
+    patch(requested, e.position());
+    patch(bail, e.position());
+    e.rbx({ 0x66, 0xC7 }, 0, l.pc);                     // mov word [pc], addr
+    e.imm16(addr);
+    patch(e.jump({ 0xE9 }), this->exit);
+
+    for (const Exit& exit : exits) {
+        patch(exit.site, e.position());
+        e.rbx({ 0x66, 0xC7 }, 0, l.pc);                 // mov word [pc], target
+        e.imm16(exit.target);
+        patch(e.jump({ 0xE9 }), this->exit);
+    }
+
+    /* Writes to clean pages, with the stack 16-byte aligned for the call */
+    for (const Claim& claim : claims) {
+        patch(claim.site, e.position());
+        e.bytes({ 0x50 });                              // push rax
+        e.bytes({ 0x48, 0x89, 0xDF });                  // mov rdi, rbx
+        e.bytes({ 0x89, 0xC6 });                        // mov esi, eax
+        if (claim.immediate) {
+            e.bytes({ 0xBA });                          // mov edx, imm32
+            e.imm32(claim.value);
+        }
+        else {
+            e.bytes({ 0x0F, 0xB6, 0xD1 });              // movzx edx, cl
+        }
+        e.bytes({ 0x48, 0xB8 });                        // mov rax, write_memory
+        e.imm64(reinterpret_cast<u64>(&write_memory));
+        e.bytes({ 0xFF, 0xD0 });                        // call rax
+        e.bytes({ 0x58 });                              // pop rax
+        patch(e.jump({ 0xE9 }), claim.resume);          // jmp resume
+    }
+
+    this->used = static_cast<size_t>(e.position() - this->code);
+    this->blocks[addr] = start;
+
+    /* Chain blocks that were waiting for this one */
+    auto waiting = this->unresolved.equal_range(addr);
+    for (auto it = waiting.first; it != waiting.second; ++it) {
+        patch(it->second, start);
+    }
+    this->unresolved.erase(addr);
+
+    for (const Exit& exit : exits) {
+        this->link(exit.site, exit.target);
+    }
+
+    return this->protect(false) ? start : nullptr;
+}
+
+void Jit::link(u8* site, u16 target) {
+    if (this->blocks[target] != nullptr) {
+        patch(site, this->blocks[target]);
+    }
+    else {
+        this->unresolved.emplace(target, site);
+    }
+}
+
+bool Jit::protect(bool writable) {
+#if MCU_JIT_AVAILABLE
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    if (mprotect(this->code, this->capacity, protection) == 0) {
+        return true;
+    }
+
+    /* Never run code that could not be made executable, or written again */
+    munmap(this->code, this->capacity);
+    this->code = nullptr;
+#else
+    static_cast<void>(writable);
+#endif
+    return false;
+}
+
+void Jit::flush() {
+    this->used = this->trampoline_size;
+    std::fill(this->blocks.begin(), this->blocks.end(), nullptr);
+    this->unresolved.clear();
+}
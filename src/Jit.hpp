@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <Instruction.hpp>
+#include <typedefs.hpp>
+
+class McuBase;
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(__APPLE__)
+#   define MCU_JIT_AVAILABLE 1
+#else
+#   define MCU_JIT_AVAILABLE 0
+#endif
+
+/* Translates basic blocks of the MCU instruction set to x86-64.
+ *
+ * Blocks end at the first control transfer or before the first instruction
+ * that must go through the interpreter (SLEEP, BREAK, SEI, RETI, IN, OUT,
+ * illegal opcodes and idle loops). Static exits are patched to jump
+ * straight into their target block once it exists, RET looks its target up
+ * in the block table.
+ *
+ * Translated code keeps no architectural state in host registers between
+ * instructions: every result is written back to the Mcu, so the interpreter
+ * can take over at any block boundary. Memory is read through its page table
+ * and written in place when the page is dirty; the first write to a clean
+ * page calls out to Memory::write() to copy it.
+ *
+ * The code buffer is never writable and executable at once: compile()
+ * makes it read-write while it emits and patches, then read-execute again.
+ * If the buffer cannot be mapped or either switch fails, there is no code
+ * to run and run() always returns false, leaving Engine::Jit to execute
+ * one instruction at a time with the switch interpreter.
+ */
+class Jit {
+public:
+    explicit Jit(const McuBase& mcu);
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    /* Runs translated code starting at `mcu.pc` for at most `cycles`,
+     * chaining through as many blocks as the budget allows and counting
+     * `mcu.instructions` as it goes. Returns false if the instruction at
+     * `mcu.pc` cannot be translated. */
+    bool run(McuBase& mcu, u64& cycles);
+
+    static bool translatable(const Instruction& insn);
+
+    /* Translated code is patched as it runs, so it belongs to one thread */
+    const std::thread::id thread = std::this_thread::get_id();
+
+private:
+    struct Layout {
+        i32 pc;
+        i32 sp;
+        i32 registers;
+        i32 carry;
+        i32 zero;
+        i32 interrupt;
+        i32 pages;
+        i32 dirty;
+        i32 instructions;
+        i32 program;
+        i32 requests;
+    };
+
+    using Entry = void (*)(McuBase* mcu, u64* cycles, const u8* block);
+
+    /* Returns nullptr, with the buffer gone, if it cannot be protected */
+    const u8* compile(const McuBase& mcu, u16 addr);
+    void link(u8* site, u16 target);
+    void flush();
+
+    /* Makes the code buffer read-write or read-execute, unmapping it if that
+     * fails */
+    bool protect(bool writable);
+
+    Layout layout {};
+
+    u8* code = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t trampoline_size = 0;
+
+    Entry entry = nullptr;
+    const u8* exit = nullptr;
+
+    /* Translated block for each guest address, or nullptr */
+    std::vector<const u8*> blocks;
+
+    /* Jumps waiting for their target block to be translated */
+    std::unordered_multimap<u16, u8*> unresolved;
+};
@@ -1,347 +1,151 @@
 #include <Mcu.hpp>
+#include <McuImpl.hpp>
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <stdexcept>
 
 #include <fmt/format.h>
 
+#include <handlers.hpp>
 #include <opcodes.hpp>
 #include <interrupts.hpp>
 #include <util.hpp>
 
+static_assert(INTERRUPT_SOURCES <= 8);
+
 illegal_opcode_error::illegal_opcode_error(u8 opcode)
     : std::domain_error { fmt::format("Illegal opcode {:0x}", opcode) }
 { }
 
-void Mcu::load_program(const std::vector<u8>& binary) {
-    if (binary.size() > this->program.size()) {
-        std::copy(binary.begin(), binary.begin() + this->program.size(), this->program.begin());
-    }
-    std::copy(binary.begin(), binary.end(), this->program.begin());
+void McuBase::load_program(const std::vector<u8>& binary) {
+    this->load_image(ProgramImage::create(binary));
 }
 
-void Mcu::reset() {
+void McuBase::load_image(std::shared_ptr<const ProgramImage> image) {
+    this->image = std::move(image);
+    this->program = this->image->bytes().data();
+    this->decoded = this->image->decoded();
+    this->jit.reset();
+}
+
+void McuBase::reset() {
     this->pc = 0x0000;
     this->sp = 0xFFFF;
 
     this->registers = {};
-    this->memory = {};
+    this->memory.reset();
 
     this->flags = {};
     this->interrupts = {};
 
     this->sleeping = false;
-}
+    this->trap = {};
 
-void Mcu::steps(u16 steps) {
-    for (u16 i = 0; i < steps; i++) {
-        this->step();
-    }
+    this->cycles = 0;
+    this->instructions = 0;
 }
 
-void Mcu::step() {
-    if (this->flags.interrupt && this->interrupt_occured()) {
-        this->sleeping = false;
-        this->flags.interrupt = false;
-        this->push_u16(this->pc);
-
-        if (this->interrupts.vblank) {
-            this->interrupts.vblank = false;
-            this->pc = VBLANK_VECTOR;
-        }
-        else if (this->interrupts.button) {
-            this->interrupts.button = false;
-            this->pc = BUTTON_VECTOR;
-        }
-        else if (this->interrupts.serial) {
-            this->interrupts.serial = false;
-            this->pc = SERIAL_VECTOR;
-        }
-    }
-
-    if (this->sleeping) {
-        return;
-    }
+McuBase::Snapshot McuBase::snapshot() {
+    return Snapshot {
+        .pc = this->pc,
+        .sp = this->sp,
+        .registers = this->registers,
+        .flags = this->flags,
+        .interrupts = this->interrupts,
+        .sleeping = this->sleeping,
+        .cycles = this->cycles,
+        .instructions = this->instructions,
+        .memory = this->memory.snapshot(),
+    };
+}
 
-    u8 opcode = this->read_byte();
+void McuBase::restore(const Snapshot& snapshot) {
+    this->pc = snapshot.pc;
+    this->sp = snapshot.sp;
+    this->registers = snapshot.registers;
+    this->flags = snapshot.flags;
+    this->interrupts = snapshot.interrupts;
+    this->sleeping = snapshot.sleeping;
+    this->cycles = snapshot.cycles;
+    this->instructions = snapshot.instructions;
+    this->memory.restore(snapshot.memory);
+}
 
+bool McuBase::branch_taken(u8 opcode) const {
     switch (opcode) {
-        case NOP: {
-            break;
-        }
-        case SLEEP: {
-            this->sleeping = true;
-            break;
-        }
-        case BREAK: {
-            break;
-        }
-        case SEI: {
-            this->flags.interrupt = true;
-            break;
-        }
-        case SEC: {
-            this->flags.carry = true;
-            break;
-        }
-        case SEZ: {
-            this->flags.zero = true;
-            break;
-        }
-        case CLI: {
-            this->flags.interrupt = false;
-            break;
-        }
-        case CLC: {
-            this->flags.carry = false;
-            break;
-        }
-        case CLZ: {
-            this->flags.zero = false;
-            break;
-        }
-        case ADD: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            this->flags.carry = __builtin_add_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case ADC: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            bool carry1 = false;
-            bool carry2 = false;
-
-            carry1 = __builtin_add_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
-            if (flags.carry) {
-                carry2 = __builtin_add_overflow(this->registers[rDst], 1, &this->registers[rDst]);
-            }
-
-            this->flags.carry = carry1 || carry2;
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case SUB: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            this->flags.carry = __builtin_sub_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case SBC: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            bool carry1 = false;
-            bool carry2 = false;
-
-            carry1 = __builtin_sub_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
-            if (flags.carry) {
-                carry2 = __builtin_sub_overflow(this->registers[rDst], 1, &this->registers[rDst]);
-            }
-
-            this->flags.carry = carry1 || carry2;
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case INC: {
-            auto rDst = this->read_register();
-            this->flags.carry = __builtin_add_overflow(this->registers[rDst], 1, &this->registers[rDst]);
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case DEC: {
-            auto rDst = this->read_register();
-            this->flags.carry = __builtin_sub_overflow(this->registers[rDst], 1, &this->registers[rDst]);
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case AND: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            this->registers[rDst] = this->registers[rDst] & this->registers[rSrc];
-            this->flags.carry = false;
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case OR: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            this->registers[rDst] = this->registers[rDst] | this->registers[rSrc];
-            this->flags.carry = false;
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case XOR: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            this->registers[rDst] = this->registers[rDst] ^ this->registers[rSrc];
-            this->flags.carry = false;
-            this->flags.zero = this->registers[rDst] == 0;
-            break;
-        }
-        case CP: {
-            auto [ r0, r1 ] = this->read_register_pair();
-            u8 result = 0;
-            this->flags.carry = __builtin_sub_overflow(this->registers[r0], this->registers[r1], &result);
-            this->flags.zero = result == 0;
-            break;
-        }
-        case CPI: {
-            auto reg = this->read_register();
-            auto val = this->read_byte();
-            u8 result = 0;
-            this->flags.carry = __builtin_sub_overflow(this->registers[reg], val, &result);
-            this->flags.zero = result == 0;
-            break;
-        }
-        case JMP: {
-            auto addr = this->read_word();
-            this->pc = addr;
-            break;
-        }
-        case CALL: {
-            auto addr = this->read_word();
-            this->push_u16(this->pc);
-            this->pc = addr;
-            break;
-        }
-        case RET: {
-            this->pc = this->pop_u16();
-            break;
-        }
-        case RETI: {
-            this->flags.interrupt = true;
-            this->pc = this->pop_u16();
-            break;
-        }
         case BRC: {
-            auto addr = this->read_word();
-            if (this->flags.carry) {
-                this->pc = addr;
-            }
-            break;
+            return this->flags.carry;
         }
         case BRNC: {
-            auto addr = this->read_word();
-            if (!this->flags.carry) {
-                this->pc = addr;
-            }
-            break;
+            return !this->flags.carry;
         }
         case BRZ: {
-            auto addr = this->read_word();
-            if (this->flags.zero) {
-                this->pc = addr;
-            }
-            break;
+            return this->flags.zero;
         }
         case BRNZ: {
-            auto addr = this->read_word();
-            if (!this->flags.zero) {
-                this->pc = addr;
-            }
-            break;
-        }
-        case MOV: {
-            auto [ rDst, rSrc ] = this->read_register_pair();
-            this->registers[rDst] = this->registers[rSrc];
-            break;
-        }
-        case LDI: {
-            auto rDst = this->read_register();
-            auto value = this->read_byte();
-            this->registers[rDst] = value;
-            break;
-        }
-        case LD: {
-            auto rDst = this->read_register();
-            auto addr = this->registers[14] << 8 | this->registers[15];
-            this->registers[rDst] = this->memory[addr];
-            break;
-        }
-        case ST: {
-            auto rDst = this->read_register();
-            auto addr = this->registers[12] << 8 | this->registers[13];
-            this->memory[addr] = this->registers[rDst];
-            break;
-        }
-        case PUSH: {
-            auto rSrc = this->read_register();
-            this->push_u8(this->registers[rSrc]);
-            break;
-        }
-        case POP: {
-            auto rDst = this->read_register();
-            this->registers[rDst] = this->pop_u8();
-            break;
-        }
-        case LPM: {
-            auto rDst = this->read_register();
-            auto addr = this->registers[14] << 8 | this->registers[15];
-            this->registers[rDst] = this->program[addr];
-            break;
-        }
-        case IN: {
-            auto rDst = this->read_register();
-            auto addr = this->read_byte();
-
-            auto it = this->io_handlers.find(addr);
-            if (it != this->io_handlers.end()) {
-                this->registers[rDst] = it->second.get();
-            }
-            break;
-        }
-        case OUT: {
-            auto rSrc = this->read_register();
-            auto addr = this->read_byte();
-
-            auto it = this->io_handlers.find(addr);
-            if (it != this->io_handlers.end()) {
-                it->second.set(this->registers[rSrc]);
-            }
-            break;
+            return !this->flags.zero;
         }
         default: {
-            throw illegal_opcode_error { opcode };
+            return true;
         }
     }
 }
 
-bool Mcu::interrupt_occured() {
-    return this->interrupts.vblank
-        || this->interrupts.button
-        || this->interrupts.serial;
-}
+void McuBase::illegal_opcode(u8 opcode, u16 addr) {
+    this->trap.raised = true;
+    this->trap.opcode = opcode;
+    this->trap.pc = addr;
 
-void Mcu::push_u8(u8 value) {
-    this->memory[sp--] = value;
+    if (this->illegal_opcode_mode == IllegalOpcodeMode::Throw) {
+        throw illegal_opcode_error { opcode };
+    }
 }
 
-void Mcu::push_u16(u16 value) {
-    this->push_u8(high_byte(value));
-    this->push_u8(low_byte(value));
-}
+void McuBase::enter_interrupt() {
+    this->sleeping = false;
+    this->flags.interrupt = false;
+    this->push_u16(this->pc);
 
-u8 Mcu::pop_u8() {
-    return this->memory[++sp];
+    u8 pending = this->interrupts.mask;
+    this->pc = interrupt_vectors[__builtin_ctz(pending)];
+    this->interrupts.mask = pending & (pending - 1);
 }
 
-u16 Mcu::pop_u16() {
-    auto low_byte = this->pop_u8();
-    auto high_byte = this->pop_u8();
-    return (high_byte << 8u) | low_byte;
+void McuBase::take_requests() {
+    u8 mask = this->requests.exchange(0, std::memory_order_acquire);
+    if (this->hold_requests) {
+        this->held_requests |= mask;
+    }
+    else {
+        this->raise_interrupts(mask);
+    }
 }
 
-u8 Mcu::read_byte() {
-    return this->program[this->pc++];
+u8 McuBase::release_requests() {
+    u8 mask = this->held_requests | this->requests.exchange(0, std::memory_order_acquire);
+    this->held_requests = 0;
+    return mask;
 }
 
-std::pair<u8, u8> Mcu::read_register_pair() {
-    u8 byte = read_byte();
-    return { high_nibble(byte), low_nibble(byte) };
+void McuBase::push_u8(u8 value) {
+    this->memory.write(sp--, value);
 }
 
-u8 Mcu::read_register() {
-    return read_register_pair().second;
+void McuBase::push_u16(u16 value) {
+    this->push_u8(high_byte(value));
+    this->push_u8(low_byte(value));
 }
 
-u16 Mcu::read_word() {
-    u8 high = read_byte();
-    u8 low  = read_byte();
+u8 McuBase::pop_u8() {
+    return this->memory.read(++sp);
+}
 
-    return static_cast<u16>(high << 8u | low);
+u16 McuBase::pop_u16() {
+    auto low_byte = this->pop_u8();
+    auto high_byte = this->pop_u8();
+    return (high_byte << 8u) | low_byte;
 }
+
+template class BasicMcu<DynamicBus>;
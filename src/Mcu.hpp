@@ -1,67 +1,317 @@
 #pragma once
 
 #include <array>
-#include <functional>
-#include <unordered_map>
-#include <utility>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
 #include <vector>
 
 #include <fmt/format.h>
 
+#include <Attachment.hpp>
+#include <Instruction.hpp>
+#include <DynamicBus.hpp>
+#include <Jit.hpp>
+#include <Memory.hpp>
+#include <ProgramImage.hpp>
+#include <Scheduler.hpp>
+#include <interrupts.hpp>
 #include <typedefs.hpp>
 
-struct IoHandler {
-    std::function<u8()> get = []() { return 0x00; };
-    std::function<void(u8)> set = [](u8) { };
-};
-
 class illegal_opcode_error : public std::domain_error {
 public:
     explicit illegal_opcode_error(u8 opcode);
 };
 
-class Mcu {
+/* std::atomic whose copies take the value along, so classes holding one
+ * keep their defaulted copy and move */
+template <typename T>
+class CopyableAtomic : public std::atomic<T> {
+public:
+    explicit CopyableAtomic(T value = T {}) noexcept
+        : std::atomic<T> { value }
+    { }
+
+    CopyableAtomic(const CopyableAtomic& other) noexcept
+        : std::atomic<T> { other.load(std::memory_order_acquire) }
+    { }
+
+    CopyableAtomic& operator=(const CopyableAtomic& other) noexcept {
+        this->store(other.load(std::memory_order_acquire), std::memory_order_relaxed);
+        return *this;
+    }
+};
+
+/* Architectural state and everything that does not depend on the I/O bus */
+class McuBase {
 public:
+    /* Execution engine used by run(), step() always uses Switch */
+    enum class Engine {
+        Switch,     /* Reference interpreter */
+        Threaded,   /* Threaded dispatch */
+        Jit,        /* x86-64 translation, falls back to Threaded elsewhere
+                     * and to Switch one instruction at a time without a
+                     * code buffer, see Jit */
+    };
+
+    enum class StopReason {
+        Budget,         /* Ran for the whole budget */
+        Sleep,          /* Sleeping with interrupts disabled */
+        Break,          /* Executed BREAK */
+        IllegalOpcode,  /* Hit an illegal opcode, pc points past it */
+    };
+
+    /* What executing an illegal opcode does */
+    enum class IllegalOpcodeMode {
+        Throw,  /* Throw illegal_opcode_error, run() catches it */
+        Trap,   /* Only record it in `trap`, never allocates or throws */
+    };
+
+    struct RunResult {
+        u64 instructions = 0;
+        u64 cycles = 0;
+        StopReason reason = StopReason::Budget;
+    };
+
+    /* Runs `program` from a new image, zero-padded to 64 KiB */
     void load_program(const std::vector<u8>& program);
+
+    /* Attaches to an existing image instead of copying the program */
+    void load_image(std::shared_ptr<const ProgramImage> image);
+
     void reset();
-    void steps(u16 steps);
-    void step();
 
-    bool interrupt_occured();
+    bool interrupt_occured() const {
+        return this->interrupts.mask != 0;
+    }
 
-    u16 pc = 0x0000;
-    u16 sp = 0xFFFF;
+    /* Whether an interrupt is pending and enabled, the check done before
+     * every instruction */
+    bool interrupt_due() const {
+        return this->flags.interrupt & (this->interrupts.mask != 0);
+    }
 
-    std::unordered_map<u8, IoHandler> io_handlers;
+    /* Pending interrupts as a mask, see interrupts.hpp for the bits */
+    u8 pending_interrupts() const {
+        return this->interrupts.mask;
+    }
 
-    std::array<u8, 16> registers {};
+    /* Adds the interrupts in `mask` to those pending, bits without a source
+     * are ignored */
+    void raise_interrupts(u8 mask) {
+        this->interrupts.mask |= mask & INTERRUPT_MASK;
+    }
 
-    std::array<u8, 0x10000> program {};
-    std::array<u8, 0x10000> memory {};
+    /* Raises the interrupts in `mask` from any thread, without locking or
+     * stopping the Mcu. The thread running it takes requests at block
+     * boundaries, event deadlines and the start of run() or step(); an Mcu
+     * skipping ahead while asleep sees them on its next run(). */
+    void request_interrupts(u8 mask) {
+        this->requests.fetch_or(mask, std::memory_order_release);
+    }
 
-    struct {
+    /* Takes requests from other threads if there are any, cheap enough to
+     * call at every block boundary */
+    void poll_requests() {
+        if (this->requests.load(std::memory_order_relaxed) != 0) {
+            this->take_requests();
+        }
+    }
+
+    /* Raises the requests made so far, or keeps them in `held_requests`
+     * while `hold_requests` is set */
+    void take_requests();
+
+    /* Requests held so far and any still in flight, for the caller to raise */
+    u8 release_requests();
+
+    /* Hot state, touched by every instruction, kept together in the first
+     * cache line */
+    alignas(64) u16 pc = 0x0000;
+    u16 sp = 0xFFFF;
+
+    std::array<u8, 16> registers {};
+
+    struct Flags {
         bool carry = false;
         bool zero = false;
         bool interrupt = false;
     } flags;
 
-    struct {
-        bool vblank = false;
-        bool button = false;
-        bool serial = false;
+    /* Pending interrupts, a bit for each source in interrupts.hpp, which is
+     * all a new source needs */
+    struct Interrupts {
+        u8 mask = 0;
+
+        bool vblank() const {
+            return (this->mask >> VBLANK_INTERRUPT & 1u) != 0;
+        }
+
+        bool button() const {
+            return (this->mask >> BUTTON_INTERRUPT & 1u) != 0;
+        }
+
+        bool serial() const {
+            return (this->mask >> SERIAL_INTERRUPT & 1u) != 0;
+        }
     } interrupts;
 
     bool sleeping = false;
 
-private:
+    /* Interrupts requested by other threads, see request_interrupts().
+     * Copies take those not taken yet along. */
+    CopyableAtomic<u8> requests { 0 };
+
+    /* Emulated time in cycles, see cycles.hpp, and instructions retired.
+     * Each cycle spent asleep counts as one. */
+    u64 cycles = 0;
+    u64 instructions = 0;
+
+    /* Shortcuts into `image`: its decoded instructions, one entry per
+     * address, and its bytes */
+    const Instruction* decoded = ProgramImage::empty()->decoded();
+    const u8* program = ProgramImage::empty()->bytes().data();
+
+    Engine engine = Engine::Switch;
+    IllegalOpcodeMode illegal_opcode_mode = IllegalOpcodeMode::Throw;
+
+    /* Program memory, shared with every instance running the same image */
+    std::shared_ptr<const ProgramImage> image = ProgramImage::empty();
+
+    Memory memory;
+
+    /* Translations of `image` for the thread that last ran Engine::Jit */
+    std::shared_ptr<Jit> jit;
+
+    /* Device events, run() stops at each deadline to run them */
+    Scheduler scheduler;
+
+    /* Devices and wrappers attached, see Attachment. A plain copy shares
+     * them with the original, fork() leaves them behind. */
+    std::vector<Attachment*> attachments;
+
+    /* Set by wrappers that record interrupts, so requests are only raised
+     * where they can see them, see release_requests() */
+    bool hold_requests = false;
+    u8 held_requests = 0;
+
+    /* Set by wrappers that record interrupts, so they run due events
+     * themselves, see run() */
+    bool hold_events = false;
+
+    /* Last illegal opcode executed, in both modes */
+    struct {
+        bool raised = false;
+        u8 opcode = 0x00;
+        u16 pc = 0x0000;
+    } trap;
+
+    /* Everything running a program can change */
+    struct Snapshot {
+        u16 pc = 0x0000;
+        u16 sp = 0xFFFF;
+        std::array<u8, 16> registers {};
+        Flags flags {};
+        Interrupts interrupts {};
+        bool sleeping = false;
+        u64 cycles = 0;
+        u64 instructions = 0;
+        std::shared_ptr<const Memory::Pages> memory;
+    };
+
+    /* Captures the mutable state, handing the memory pages written since the
+     * last snapshot over to it and sharing the rest */
+    Snapshot snapshot();
+
+    /* Goes back to `snapshot`, repointing only the memory pages that changed */
+    void restore(const Snapshot& snapshot);
+
+protected:
+    /* Records an illegal opcode at `addr`, throws unless trapping */
+    void illegal_opcode(u8 opcode, u16 addr);
+
+    /* Idle loop support, see IDLE_LOOP */
+    bool branch_taken(u8 opcode) const;
+
+    /* Takes the pending interrupt with the lowest bit, one must be pending */
+    void enter_interrupt();
+
     void push_u8(u8 value);
     void push_u16(u16 value);
 
     u8 pop_u8();
     u16 pop_u16();
+};
+
+/* The MCU with its port accesses going through `Bus`, which must provide
+ *
+ *   void io_read(u8 port, u8& value)   reads `port` into `value`, leaves it
+ *                                      alone if nothing is mapped there
+ *   void io_write(u8 port, u8 value)
+ *   u64 io_peek(u8 port, u8& value)    how many reads of `port` in a row
+ *                                      would give the same value without
+ *                                      side effects, setting `value` to it,
+ *                                      see IoTap::peek()
+ *   void io_skip(u8 port, u8 value, u64 reads)
+ *                                      stands for `reads` of those reads
+ *
+ * The bus is a base class, so its members are reachable through the MCU.
+ * With a bus known at compile time port accesses inline into the engines.
+ * Member definitions live in McuImpl.hpp, BasicMcu<DynamicBus> is compiled
+ * into the library.
+ */
+template <typename Bus>
+class BasicMcu : public McuBase, public Bus {
+public:
+    void steps(u16 steps);
+    void step();
+
+    /* Runs for `budget` cycles with the selected engine, the last instruction
+     * may end a few cycles past them. With `hold_events` set, returns early
+     * as soon as an event is due instead of running it, events scheduled by
+     * port handlers along the way included. */
+    RunResult run(u64 budget);
+
+    /* New instance in the current state, leaving this one as it is. Memory
+     * pages are shared copy-on-write, see Memory, so a fork costs in
+     * proportion to the pages written since the last snapshot; the program
+     * image and translations are shared too.
+     *
+     * Attachments are left behind, see Attachment: the fork has none of the
+     * parent's devices, port handlers or events, and attaching copies of
+     * them carries the device state over. Anything else on the bus and in
+     * the scheduler is copied as it is, so handlers and callbacks capturing
+     * the parent keep acting on the parent. */
+    std::unique_ptr<BasicMcu> fork() const;
 
-    u8 read_byte();
-    u8 read_register();
-    std::pair<u8, u8> read_register_pair();
-    u16 read_word();
+private:
+    StopReason run_engine(u64 deadline);
+    StopReason run_switch(u64 deadline);
+    StopReason run_threaded(u64 deadline);
+    StopReason run_jit(u64 deadline);
+
+    /* Single step, returns why to stop after SLEEP, BREAK, an illegal opcode
+     * or while asleep, Budget otherwise */
+    StopReason execute();
+
+    /* Idle loop support, see IDLE_LOOP */
+    struct IdleLoop {
+        u64 instructions = 0;
+        u64 cycles = 0;
+    };
+
+    IdleLoop skip_idle_loop(const Instruction& branch, u16 addr, u64 budget);
+
+    /* Executes the branch at pc, then skips what is left of the loop up to
+     * `deadline`. Returns why to stop like execute(). */
+    StopReason run_idle_loop(u64 deadline);
+
+    /* Cycle run_switch() and run_jit() stop at. Port handlers can schedule
+     * events, so execute() pulls it in to the next one after IN and OUT. */
+    u64 engine_deadline = 0;
 };
+
+extern template class BasicMcu<DynamicBus>;
+
+/* Ports mapped at run time through `io_handlers` */
+using Mcu = BasicMcu<DynamicBus>;
@@ -0,0 +1,487 @@
+#pragma once
+
+/* Definitions of the BasicMcu members, include this to instantiate BasicMcu
+ * with a bus of your own */
+
+#include <Mcu.hpp>
+#include <McuThreaded.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <cycles.hpp>
+#include <handlers.hpp>
+#include <opcodes.hpp>
+#include <util.hpp>
+
+template <typename Bus>
+void BasicMcu<Bus>::steps(u16 steps) {
+    for (u16 i = 0; i < steps; i++) {
+        this->step();
+    }
+}
+
+template <typename Bus>
+void BasicMcu<Bus>::step() {
+    this->poll_requests();
+    this->scheduler.run_due(this->cycles);
+    this->execute();
+}
+
+template <typename Bus>
+std::unique_ptr<BasicMcu<Bus>> BasicMcu<Bus>::fork() const {
+    auto child = std::make_unique<BasicMcu>(*this);
+
+    for (const Attachment* attachment : this->attachments) {
+        attachment->leave(*child);
+    }
+    child->attachments.clear();
+
+    return child;
+}
+
+template <typename Bus>
+McuBase::RunResult BasicMcu<Bus>::run(u64 budget) {
+    const u64 start_cycles = this->cycles;
+    const u64 start_instructions = this->instructions;
+    const u64 deadline = this->cycles + std::min(budget, UINT64_MAX - this->cycles);
+
+    StopReason reason = StopReason::Budget;
+
+    try {
+        while (this->cycles < deadline) {
+            this->poll_requests();
+            if (!this->hold_events) {
+                this->scheduler.run_due(this->cycles);
+            }
+            else if (this->scheduler.next_deadline() <= this->cycles) {
+                break;
+            }
+            u64 until = std::min(deadline, this->scheduler.next_deadline());
+
+            if (this->sleeping && !this->interrupt_due()) {
+                if (!this->flags.interrupt) {
+                    reason = StopReason::Sleep;
+                    break;
+                }
+
+                /* Only an event or the host can wake us up now, skip to
+                 * whichever comes first */
+                this->cycles = until;
+                continue;
+            }
+
+            StopReason stop = this->run_engine(until);
+            if (stop == StopReason::Break || stop == StopReason::IllegalOpcode) {
+                reason = stop;
+                break;
+            }
+        }
+    }
+    catch (const illegal_opcode_error&) {
+        reason = StopReason::IllegalOpcode;
+    }
+
+    return RunResult {
+        .instructions = this->instructions - start_instructions,
+        .cycles = this->cycles - start_cycles,
+        .reason = reason,
+    };
+}
+
+template <typename Bus>
+McuBase::StopReason BasicMcu<Bus>::run_engine(u64 deadline) {
+    switch (this->engine) {
+        case Engine::Threaded: {
+            return this->run_threaded(deadline);
+        }
+        case Engine::Jit: {
+            return MCU_JIT_AVAILABLE ? this->run_jit(deadline) : this->run_threaded(deadline);
+        }
+        case Engine::Switch:
+        default: {
+            return this->run_switch(deadline);
+        }
+    }
+}
+
+template <typename Bus>
+McuBase::StopReason BasicMcu<Bus>::run_switch(u64 deadline) {
+    this->engine_deadline = deadline;
+
+    while (this->cycles < this->engine_deadline) {
+        this->poll_requests();
+
+        StopReason stop = this->execute();
+        if (stop != StopReason::Budget) {
+            return stop;
+        }
+    }
+    return StopReason::Budget;
+}
+
+template <typename Bus>
+McuBase::StopReason BasicMcu<Bus>::run_jit(u64 deadline) {
+    if (!this->jit || this->jit->thread != std::this_thread::get_id()) {
+        this->jit = this->image->translations(*this);
+    }
+
+    this->engine_deadline = deadline;
+
+    while (this->cycles < this->engine_deadline) {
+        /* Blocks leave as soon as there is a request */
+        this->poll_requests();
+
+        /* Interrupt entry and sleeping always go through the interpreter */
+        if (!this->sleeping && !this->interrupt_due()) {
+            u64 budget = this->engine_deadline - this->cycles;
+            u64 remaining = budget;
+
+            if (this->jit->run(*this, remaining) && remaining != budget) {
+                this->cycles += budget - remaining;
+                continue;
+            }
+
+            if (this->decoded[this->pc].handler == IDLE_LOOP) {
+                if (StopReason stop = this->run_idle_loop(this->engine_deadline); stop != StopReason::Budget) {
+                    return stop;
+                }
+                continue;
+            }
+        }
+
+        StopReason stop = this->execute();
+        if (stop != StopReason::Budget) {
+            return stop;
+        }
+    }
+    return StopReason::Budget;
+}
+
+/* Skips as many whole iterations of the loop closed by `branch` (located at
+ * `addr`) as fit in `budget` cycles if running them would not change any
+ * state, returning what they would have taken. Expects the branch to have
+ * just been taken. */
+template <typename Bus>
+typename BasicMcu<Bus>::IdleLoop BasicMcu<Bus>::skip_idle_loop(const Instruction& branch, u16 addr, u64 budget) {
+    u64 branch_cost = branch_cycles(branch.opcode, true);
+
+    if (branch.target == addr) {
+        u64 iterations = budget / branch_cost;
+        return IdleLoop { iterations, iterations * branch_cost };
+    }
+
+    /* Poll loop, only idle while the port keeps giving what the last
+     * iteration read, and if that left the flags the way the next one
+     * would. Every iteration skipped still counts as a read of the port. */
+    const Instruction& in = this->decoded[branch.target];
+    const Instruction& compare = this->decoded[static_cast<u16>(branch.target + in.length)];
+
+    u8 value = this->registers[in.a];
+    u64 reads = this->io_peek(in.b, value);
+
+    if (reads == 0 || value != this->registers[in.a]) {
+        return IdleLoop {};
+    }
+
+    u8 result = 0;
+    u8 operand = compare.opcode == CPI ? compare.b : this->registers[compare.b];
+    bool carry = __builtin_sub_overflow(this->registers[compare.a], operand, &result);
+
+    if (carry != this->flags.carry || (result == 0) != this->flags.zero) {
+        return IdleLoop {};
+    }
+
+    u64 cycles = in.cycles + compare.cycles + branch_cost;
+    u64 iterations = std::min(budget / cycles, reads);
+    if (iterations != 0) {
+        this->io_skip(in.b, value, iterations);
+    }
+    return IdleLoop { iterations * 3, iterations * cycles };
+}
+
+template <typename Bus>
+McuBase::StopReason BasicMcu<Bus>::run_idle_loop(u64 deadline) {
+    u16 addr = this->pc;
+    const Instruction& branch = this->decoded[addr];
+
+    if (StopReason stop = this->execute(); stop != StopReason::Budget) {
+        return stop;
+    }
+
+    if (this->pc == branch.target && this->branch_taken(branch.opcode) && this->cycles < deadline) {
+        IdleLoop skipped = this->skip_idle_loop(branch, addr, deadline - this->cycles);
+        this->cycles += skipped.cycles;
+        this->instructions += skipped.instructions;
+    }
+    return StopReason::Budget;
+}
+
+template <typename Bus>
+McuBase::StopReason BasicMcu<Bus>::execute() {
+    if (this->interrupt_due()) {
+        this->enter_interrupt();
+        this->cycles += INTERRUPT_CYCLES;
+    }
+
+    if (this->sleeping) {
+        this->cycles++;
+        return StopReason::Sleep;
+    }
+
+    const Instruction& insn = this->decoded[this->pc];
+    this->pc += insn.length;
+
+    this->cycles += insn.cycles;
+    this->instructions++;
+
+    switch (insn.opcode) {
+        case NOP: {
+            break;
+        }
+        case SLEEP: {
+            this->sleeping = true;
+            return StopReason::Sleep;
+        }
+        case BREAK: {
+            return StopReason::Break;
+        }
+        case SEI: {
+            this->flags.interrupt = true;
+            break;
+        }
+        case SEC: {
+            this->flags.carry = true;
+            break;
+        }
+        case SEZ: {
+            this->flags.zero = true;
+            break;
+        }
+        case CLI: {
+            this->flags.interrupt = false;
+            break;
+        }
+        case CLC: {
+            this->flags.carry = false;
+            break;
+        }
+        case CLZ: {
+            this->flags.zero = false;
+            break;
+        }
+        case ADD: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            this->flags.carry = __builtin_add_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case ADC: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            bool carry1 = false;
+            bool carry2 = false;
+
+            carry1 = __builtin_add_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
+            if (flags.carry) {
+                carry2 = __builtin_add_overflow(this->registers[rDst], 1, &this->registers[rDst]);
+            }
+
+            this->flags.carry = carry1 || carry2;
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case SUB: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            this->flags.carry = __builtin_sub_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case SBC: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            bool carry1 = false;
+            bool carry2 = false;
+
+            carry1 = __builtin_sub_overflow(this->registers[rDst], this->registers[rSrc], &this->registers[rDst]);
+            if (flags.carry) {
+                carry2 = __builtin_sub_overflow(this->registers[rDst], 1, &this->registers[rDst]);
+            }
+
+            this->flags.carry = carry1 || carry2;
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case INC: {
+            auto rDst = insn.a;
+            this->flags.carry = __builtin_add_overflow(this->registers[rDst], 1, &this->registers[rDst]);
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case DEC: {
+            auto rDst = insn.a;
+            this->flags.carry = __builtin_sub_overflow(this->registers[rDst], 1, &this->registers[rDst]);
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case AND: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            this->registers[rDst] = this->registers[rDst] & this->registers[rSrc];
+            this->flags.carry = false;
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case OR: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            this->registers[rDst] = this->registers[rDst] | this->registers[rSrc];
+            this->flags.carry = false;
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case XOR: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            this->registers[rDst] = this->registers[rDst] ^ this->registers[rSrc];
+            this->flags.carry = false;
+            this->flags.zero = this->registers[rDst] == 0;
+            break;
+        }
+        case CP: {
+            auto r0 = insn.a;
+            auto r1 = insn.b;
+            u8 result = 0;
+            this->flags.carry = __builtin_sub_overflow(this->registers[r0], this->registers[r1], &result);
+            this->flags.zero = result == 0;
+            break;
+        }
+        case CPI: {
+            auto reg = insn.a;
+            auto val = insn.b;
+            u8 result = 0;
+            this->flags.carry = __builtin_sub_overflow(this->registers[reg], val, &result);
+            this->flags.zero = result == 0;
+            break;
+        }
+        case JMP: {
+            auto addr = insn.target;
+            this->pc = addr;
+            break;
+        }
+        case CALL: {
+            auto addr = insn.target;
+            this->push_u16(this->pc);
+            this->pc = addr;
+            break;
+        }
+        case RET: {
+            this->pc = this->pop_u16();
+            break;
+        }
+        case RETI: {
+            this->flags.interrupt = true;
+            this->pc = this->pop_u16();
+            break;
+        }
+        case BRC: {
+            auto addr = insn.target;
+            if (this->flags.carry) {
+                this->pc = addr;
+                this->cycles += BRANCH_TAKEN_CYCLES;
+            }
+            break;
+        }
+        case BRNC: {
+            auto addr = insn.target;
+            if (!this->flags.carry) {
+                this->pc = addr;
+                this->cycles += BRANCH_TAKEN_CYCLES;
+            }
+            break;
+        }
+        case BRZ: {
+            auto addr = insn.target;
+            if (this->flags.zero) {
+                this->pc = addr;
+                this->cycles += BRANCH_TAKEN_CYCLES;
+            }
+            break;
+        }
+        case BRNZ: {
+            auto addr = insn.target;
+            if (!this->flags.zero) {
+                this->pc = addr;
+                this->cycles += BRANCH_TAKEN_CYCLES;
+            }
+            break;
+        }
+        case MOV: {
+            auto rDst = insn.a;
+            auto rSrc = insn.b;
+            this->registers[rDst] = this->registers[rSrc];
+            break;
+        }
+        case LDI: {
+            auto rDst = insn.a;
+            auto value = insn.b;
+            this->registers[rDst] = value;
+            break;
+        }
+        case LD: {
+            auto rDst = insn.a;
+            auto addr = this->registers[14] << 8 | this->registers[15];
+            this->registers[rDst] = this->memory.read(addr);
+            break;
+        }
+        case ST: {
+            auto rDst = insn.a;
+            auto addr = this->registers[12] << 8 | this->registers[13];
+            this->memory.write(addr, this->registers[rDst]);
+            break;
+        }
+        case PUSH: {
+            auto rSrc = insn.a;
+            this->push_u8(this->registers[rSrc]);
+            break;
+        }
+        case POP: {
+            auto rDst = insn.a;
+            this->registers[rDst] = this->pop_u8();
+            break;
+        }
+        case LPM: {
+            auto rDst = insn.a;
+            auto addr = this->registers[14] << 8 | this->registers[15];
+            this->registers[rDst] = this->program[addr];
+            break;
+        }
+        case IN: {
+            auto rDst = insn.a;
+            auto addr = insn.b;
+
+            this->io_read(addr, this->registers[rDst]);
+            this->engine_deadline = std::min(this->engine_deadline, this->scheduler.next_deadline());
+            break;
+        }
+        case OUT: {
+            auto rSrc = insn.a;
+            auto addr = insn.b;
+
+            this->io_write(addr, this->registers[rSrc]);
+            this->engine_deadline = std::min(this->engine_deadline, this->scheduler.next_deadline());
+            break;
+        }
+        default: {
+            this->illegal_opcode(insn.opcode, static_cast<u16>(this->pc - insn.length));
+            return StopReason::IllegalOpcode;
+        }
+    }
+
+    return StopReason::Budget;
+}
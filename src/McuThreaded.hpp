@@ -0,0 +1,470 @@
+#pragma once
+
+#include <Mcu.hpp>
+
+#include <algorithm>
+#include <cstdint>
+
+#include <cycles.hpp>
+#include <handlers.hpp>
+#include <opcodes.hpp>
+
+/* Threaded interpreter.
+ *
+ * Every handler ends by fetching and jumping to the next handler itself, so
+ * there is no central dispatch branch and no per-instruction call. Leaves
+ * after SLEEP and BREAK so that run() can decide how to continue. The
+ * interrupt check only runs after instructions that can make an interrupt
+ * deliverable (SEI, RETI and port accesses, whose handlers may raise one);
+ * nothing else can change `flags.interrupt` or `interrupts` mid-batch.
+ * Loops the decoder marked as IDLE_LOOP are skipped up to the deadline, fused
+ * compare-and-branch pairs run as one handler.
+ *
+ * The budget counts down in cycles and may go negative by the last
+ * instruction's cost, the same overshoot execute() has.
+ *
+ * GCC and Clang dispatch through a table of label addresses, other compilers
+ * fall back to a switch inside the same loop.
+ */
+
+#if defined(__GNUC__)
+#   define MCU_COMPUTED_GOTO 1
+#else
+#   define MCU_COMPUTED_GOTO 0
+#endif
+
+#if MCU_COMPUTED_GOTO
+#   define TARGET(op)      op_##op
+#   define TARGET_ILLEGAL  op_ILLEGAL
+#   define DISPATCH()      goto *dispatch_table[insn->handler]
+#else
+#   define TARGET(op)      case op
+#   define TARGET_ILLEGAL  default
+#   define DISPATCH()      goto dispatch
+#endif
+
+/* Retire the current instruction, false when out of budget */
+#define RETIRE() (++retired, (remaining -= insn->cycles) > 0)
+
+/* Retire the current instruction and start the next one */
+#define NEXT() do {                                 \
+        if (!RETIRE()) goto done;                   \
+        insn = &code[pc];                           \
+        pc += insn->length;                         \
+        DISPATCH();                                 \
+    } while (false)
+
+/* Retire a control transfer and start the next block, taking requests from
+ * other threads first if there are any */
+#define NEXT_BLOCK() do {                                           \
+        if (this->requests.load(std::memory_order_relaxed) != 0) {  \
+            if (!RETIRE()) goto done;                               \
+            this->take_requests();                                  \
+            goto check;                                             \
+        }                                                           \
+        NEXT();                                                     \
+    } while (false)
+
+/* Retire the current instruction, then re-check interrupts and sleep */
+#define NEXT_CHECKED() do {                         \
+        if (!RETIRE()) goto done;                   \
+        goto check;                                 \
+    } while (false)
+
+/* Take a conditional branch */
+#define BRANCH() do {                               \
+        pc = insn->target;                          \
+        remaining -= BRANCH_TAKEN_CYCLES;           \
+    } while (false)
+
+/* Retire the first half of a fused pair, then its branch at `pc` unless the
+ * budget runs out in between */
+#define NEXT_BRANCH(taken) do {                     \
+        if (!RETIRE()) goto done;                   \
+        insn = &code[pc];                           \
+        pc += insn->length;                         \
+        if (taken) BRANCH();                        \
+        NEXT_BLOCK();                               \
+    } while (false)
+
+/* Bring pc and the counters up to date for a port handler, counting the
+ * current instruction like execute() does. RETIRE() wraps `retired` back
+ * to zero. */
+#define SYNC() do {                                                         \
+        this->pc = pc;                                                      \
+        this->cycles += static_cast<u64>(budget - remaining) + insn->cycles; \
+        this->instructions += retired + 1;                                  \
+        budget = remaining - insn->cycles;                                  \
+        retired = UINT64_MAX;                                               \
+    } while (false)
+
+/* After a port handler, pull the deadline in to the next event in case the
+ * handler scheduled an earlier one */
+#define CLAMP() do {                                                        \
+        u64 next = this->scheduler.next_deadline();                         \
+        i64 left = next > this->cycles                                      \
+            ? static_cast<i64>(std::min<u64>(next - this->cycles, INT64_MAX)) \
+            : 0;                                                            \
+        if (left < budget) {                                                \
+            remaining -= budget - left;                                     \
+            budget = left;                                                  \
+        }                                                                   \
+    } while (false)
+
+/* Retire the current instruction and leave */
+#define STOP(reason) do {                           \
+        RETIRE();                                   \
+        stop = reason;                              \
+        goto done;                                  \
+    } while (false)
+
+template <typename Bus>
+McuBase::StopReason BasicMcu<Bus>::run_threaded(u64 deadline) {
+#if MCU_COMPUTED_GOTO
+#   define ILLEGAL_1  &&op_ILLEGAL
+#   define ILLEGAL_2  ILLEGAL_1, ILLEGAL_1
+#   define ILLEGAL_4  ILLEGAL_2, ILLEGAL_2
+#   define ILLEGAL_8  ILLEGAL_4, ILLEGAL_4
+#   define ILLEGAL_16 ILLEGAL_8, ILLEGAL_8
+#   define ILLEGAL_64 ILLEGAL_16, ILLEGAL_16, ILLEGAL_16, ILLEGAL_16
+
+    static const void* const dispatch_table[0x100] = {
+        /* 0x00 */ &&op_NOP, ILLEGAL_1, &&op_SLEEP, &&op_BREAK,
+        /* 0x04 */ &&op_SEI, &&op_SEC, &&op_SEZ, &&op_CLI,
+        /* 0x08 */ &&op_CLC, &&op_CLZ, ILLEGAL_2,
+        /* 0x0C */ ILLEGAL_4,
+        /* 0x10 */ &&op_ADD, &&op_ADC, &&op_SUB, &&op_SBC,
+        /* 0x14 */ &&op_INC, &&op_DEC, &&op_AND, &&op_OR,
+        /* 0x18 */ &&op_XOR, &&op_CP, &&op_CPI, ILLEGAL_1,
+        /* 0x1C */ ILLEGAL_4,
+        /* 0x20 */ &&op_JMP, &&op_CALL, &&op_RET, &&op_RETI,
+        /* 0x24 */ &&op_BRC, &&op_BRNC, &&op_BRZ, &&op_BRNZ,
+        /* 0x28 */ ILLEGAL_8,
+        /* 0x30 */ &&op_MOV, &&op_LDI, &&op_LD, &&op_ST,
+        /* 0x34 */ &&op_PUSH, &&op_POP, &&op_LPM, ILLEGAL_1,
+        /* 0x38 */ ILLEGAL_2, &&op_IN, &&op_OUT,
+        /* 0x3C */ ILLEGAL_4,
+        /* 0x40 */ &&op_IDLE_LOOP, &&op_CP_BRZ, &&op_CP_BRNZ, &&op_CPI_BRZ,
+        /* 0x44 */ &&op_CPI_BRNZ, &&op_DEC_BRNZ, ILLEGAL_2, ILLEGAL_8,
+        /* 0x50 */ ILLEGAL_16,
+        /* 0x60 */ ILLEGAL_16, ILLEGAL_16,
+        /* 0x80 */ ILLEGAL_64, ILLEGAL_64,
+    };
+
+    /* The table lists the synthetic handlers at these numbers */
+    static_assert(IDLE_LOOP == 0x40 && CP_BRZ == 0x41 && CP_BRNZ == 0x42 && CPI_BRZ == 0x43
+        && CPI_BRNZ == 0x44 && DEC_BRNZ == 0x45 && ILLEGAL == 0xFF);
+
+#   undef ILLEGAL_64
+#   undef ILLEGAL_16
+#   undef ILLEGAL_8
+#   undef ILLEGAL_4
+#   undef ILLEGAL_2
+#   undef ILLEGAL_1
+#endif
+
+    if (this->cycles >= deadline) {
+        return StopReason::Budget;
+    }
+
+    const Instruction* code = this->decoded;
+    const Instruction* insn = nullptr;
+    u16 pc = this->pc;
+
+    i64 budget = static_cast<i64>(std::min<u64>(deadline - this->cycles, INT64_MAX));
+    i64 remaining = budget;
+    u64 retired = 0;
+    StopReason stop = StopReason::Budget;
+
+check:
+    this->pc = pc;
+    if (this->interrupt_due()) {
+        this->enter_interrupt();
+        remaining -= INTERRUPT_CYCLES;
+        pc = this->pc;
+    }
+    else if (this->sleeping) {
+        stop = StopReason::Sleep;
+        goto done;
+    }
+
+    insn = &code[pc];
+    pc += insn->length;
+
+#if !MCU_COMPUTED_GOTO
+dispatch:
+    switch (insn->handler) {
+#else
+    DISPATCH();
+#endif
+
+    TARGET(NOP): {
+        NEXT();
+    }
+    TARGET(SLEEP): {
+        this->sleeping = true;
+        STOP(StopReason::Sleep);
+    }
+    TARGET(BREAK): {
+        STOP(StopReason::Break);
+    }
+    TARGET(SEI): {
+        this->flags.interrupt = true;
+        NEXT_CHECKED();
+    }
+    TARGET(SEC): {
+        this->flags.carry = true;
+        NEXT();
+    }
+    TARGET(SEZ): {
+        this->flags.zero = true;
+        NEXT();
+    }
+    TARGET(CLI): {
+        this->flags.interrupt = false;
+        NEXT();
+    }
+    TARGET(CLC): {
+        this->flags.carry = false;
+        NEXT();
+    }
+    TARGET(CLZ): {
+        this->flags.zero = false;
+        NEXT();
+    }
+    TARGET(ADD): {
+        u8& dst = this->registers[insn->a];
+        this->flags.carry = __builtin_add_overflow(dst, this->registers[insn->b], &dst);
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(ADC): {
+        u8& dst = this->registers[insn->a];
+        bool carry1 = __builtin_add_overflow(dst, this->registers[insn->b], &dst);
+        bool carry2 = this->flags.carry && __builtin_add_overflow(dst, 1, &dst);
+        this->flags.carry = carry1 || carry2;
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(SUB): {
+        u8& dst = this->registers[insn->a];
+        this->flags.carry = __builtin_sub_overflow(dst, this->registers[insn->b], &dst);
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(SBC): {
+        u8& dst = this->registers[insn->a];
+        bool carry1 = __builtin_sub_overflow(dst, this->registers[insn->b], &dst);
+        bool carry2 = this->flags.carry && __builtin_sub_overflow(dst, 1, &dst);
+        this->flags.carry = carry1 || carry2;
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(INC): {
+        u8& dst = this->registers[insn->a];
+        this->flags.carry = __builtin_add_overflow(dst, 1, &dst);
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(DEC): {
+        u8& dst = this->registers[insn->a];
+        this->flags.carry = __builtin_sub_overflow(dst, 1, &dst);
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(AND): {
+        u8& dst = this->registers[insn->a];
+        dst &= this->registers[insn->b];
+        this->flags.carry = false;
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(OR): {
+        u8& dst = this->registers[insn->a];
+        dst |= this->registers[insn->b];
+        this->flags.carry = false;
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(XOR): {
+        u8& dst = this->registers[insn->a];
+        dst ^= this->registers[insn->b];
+        this->flags.carry = false;
+        this->flags.zero = dst == 0;
+        NEXT();
+    }
+    TARGET(CP): {
+        u8 result = 0;
+        this->flags.carry = __builtin_sub_overflow(this->registers[insn->a], this->registers[insn->b], &result);
+        this->flags.zero = result == 0;
+        NEXT();
+    }
+    TARGET(CPI): {
+        u8 result = 0;
+        this->flags.carry = __builtin_sub_overflow(this->registers[insn->a], insn->b, &result);
+        this->flags.zero = result == 0;
+        NEXT();
+    }
+    TARGET(JMP): {
+        pc = insn->target;
+        NEXT_BLOCK();
+    }
+    TARGET(CALL): {
+        this->push_u16(pc);
+        pc = insn->target;
+        NEXT_BLOCK();
+    }
+    TARGET(RET): {
+        pc = this->pop_u16();
+        NEXT_BLOCK();
+    }
+    TARGET(RETI): {
+        this->flags.interrupt = true;
+        pc = this->pop_u16();
+        NEXT_CHECKED();
+    }
+    TARGET(BRC): {
+        if (this->flags.carry) {
+            BRANCH();
+        }
+        NEXT_BLOCK();
+    }
+    TARGET(BRNC): {
+        if (!this->flags.carry) {
+            BRANCH();
+        }
+        NEXT_BLOCK();
+    }
+    TARGET(BRZ): {
+        if (this->flags.zero) {
+            BRANCH();
+        }
+        NEXT_BLOCK();
+    }
+    TARGET(BRNZ): {
+        if (!this->flags.zero) {
+            BRANCH();
+        }
+        NEXT_BLOCK();
+    }
+    TARGET(MOV): {
+        this->registers[insn->a] = this->registers[insn->b];
+        NEXT();
+    }
+    TARGET(LDI): {
+        this->registers[insn->a] = insn->b;
+        NEXT();
+    }
+    TARGET(LD): {
+        auto addr = this->registers[14] << 8 | this->registers[15];
+        this->registers[insn->a] = this->memory.read(addr);
+        NEXT();
+    }
+    TARGET(ST): {
+        auto addr = this->registers[12] << 8 | this->registers[13];
+        this->memory.write(addr, this->registers[insn->a]);
+        NEXT();
+    }
+    TARGET(PUSH): {
+        this->push_u8(this->registers[insn->a]);
+        NEXT();
+    }
+    TARGET(POP): {
+        this->registers[insn->a] = this->pop_u8();
+        NEXT();
+    }
+    TARGET(LPM): {
+        auto addr = this->registers[14] << 8 | this->registers[15];
+        this->registers[insn->a] = this->program[addr];
+        NEXT();
+    }
+    TARGET(IN): {
+        SYNC();
+        this->io_read(insn->b, this->registers[insn->a]);
+        CLAMP();
+        NEXT_CHECKED();
+    }
+    TARGET(OUT): {
+        SYNC();
+        this->io_write(insn->b, this->registers[insn->a]);
+        CLAMP();
+        NEXT_CHECKED();
+    }
+    TARGET(IDLE_LOOP): {
+        if (!this->branch_taken(insn->opcode)) {
+            NEXT();
+        }
+
+        u16 addr = pc - insn->length;
+        pc = insn->target;
+        remaining -= branch_cycles(insn->opcode, true) - insn->cycles;
+
+        /* Skip whole iterations, leaving the remainder to normal execution */
+        if (remaining > insn->cycles) {
+            IdleLoop skipped = this->skip_idle_loop(*insn, addr, static_cast<u64>(remaining - insn->cycles));
+            remaining -= static_cast<i64>(skipped.cycles);
+            retired += skipped.instructions;
+        }
+        NEXT_BLOCK();
+    }
+    TARGET(CP_BRZ): {
+        u8 result = 0;
+        this->flags.carry = __builtin_sub_overflow(this->registers[insn->a], this->registers[insn->b], &result);
+        this->flags.zero = result == 0;
+        NEXT_BRANCH(this->flags.zero);
+    }
+    TARGET(CP_BRNZ): {
+        u8 result = 0;
+        this->flags.carry = __builtin_sub_overflow(this->registers[insn->a], this->registers[insn->b], &result);
+        this->flags.zero = result == 0;
+        NEXT_BRANCH(!this->flags.zero);
+    }
+    TARGET(CPI_BRZ): {
+        u8 result = 0;
+        this->flags.carry = __builtin_sub_overflow(this->registers[insn->a], insn->b, &result);
+        this->flags.zero = result == 0;
+        NEXT_BRANCH(this->flags.zero);
+    }
+    TARGET(CPI_BRNZ): {
+        u8 result = 0;
+        this->flags.carry = __builtin_sub_overflow(this->registers[insn->a], insn->b, &result);
+        this->flags.zero = result == 0;
+        NEXT_BRANCH(!this->flags.zero);
+    }
+    TARGET(DEC_BRNZ): {
+        u8& dst = this->registers[insn->a];
+        this->flags.carry = __builtin_sub_overflow(dst, 1, &dst);
+        this->flags.zero = dst == 0;
+        NEXT_BRANCH(!this->flags.zero);
+    }
+    TARGET_ILLEGAL: {
+        STOP(StopReason::IllegalOpcode);
+    }
+
+#if !MCU_COMPUTED_GOTO
+    }
+#endif
+
+done:
+    this->pc = pc;
+    this->cycles += static_cast<u64>(budget - remaining);
+    this->instructions += retired;
+
+    if (stop == StopReason::IllegalOpcode) {
+        this->illegal_opcode(insn->opcode, static_cast<u16>(insn - this->decoded));
+    }
+    return stop;
+}
+
+#undef STOP
+#undef CLAMP
+#undef SYNC
+#undef NEXT_BRANCH
+#undef BRANCH
+#undef NEXT_BLOCK
+#undef NEXT_CHECKED
+#undef NEXT
+#undef RETIRE
+#undef DISPATCH
+#undef TARGET_ILLEGAL
+#undef TARGET
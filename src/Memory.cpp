@@ -0,0 +1,149 @@
+#include <Memory.hpp>
+
+#include <cstring>
+#include <utility>
+
+namespace {
+
+/* What clean pages saved as nullptr read from, never written */
+const Memory::Page zeroes {};
+
+}
+
+Memory::Memory() {
+    this->pages.fill(zeroes.data());
+}
+
+Memory::Memory(const Memory& other)
+    : dirty { other.dirty }, pages { other.pages }, baseline { other.baseline }
+{
+    for (u32 word = 0; word < this->dirty.size(); word++) {
+        for (u64 bits = this->dirty[word]; bits != 0; bits &= bits - 1) {
+            u32 page = word * 64 + static_cast<u32>(__builtin_ctzll(bits));
+
+            this->owned[page] = std::make_shared<Page>(*other.owned[page]);
+            this->pages[page] = this->owned[page]->data();
+        }
+    }
+}
+
+Memory& Memory::operator=(const Memory& other) {
+    if (this != &other) {
+        Memory copy { other };
+        this->swap(copy);
+    }
+    return *this;
+}
+
+Memory::Memory(Memory&& other) noexcept
+    : Memory {}
+{
+    this->swap(other);
+}
+
+Memory& Memory::operator=(Memory&& other) noexcept {
+    Memory moved { std::move(other) };
+    this->swap(moved);
+    return *this;
+}
+
+void Memory::read(u16 addr, u8* data, u32 count) const {
+    for (u32 done = 0; done < count;) {
+        u32 at = addr + done;
+        u32 chunk = std::min(count - done, page_size - at % page_size);
+        std::memcpy(data + done, this->pages[at / page_size] + at % page_size, chunk);
+        done += chunk;
+    }
+}
+
+u32 Memory::dirty_count() const {
+    u32 count = 0;
+    for (u64 word : this->dirty) {
+        count += static_cast<u32>(__builtin_popcountll(word));
+    }
+    return count;
+}
+
+void Memory::reset() {
+    this->restore(nullptr);
+}
+
+std::shared_ptr<const Memory::Pages> Memory::snapshot() {
+    if (this->dirty_count() == 0) {
+        return this->baseline;
+    }
+
+    auto pages = this->baseline ? std::make_shared<Pages>(*this->baseline) : std::make_shared<Pages>();
+
+    for (u32 word = 0; word < this->dirty.size(); word++) {
+        for (u64 bits = this->dirty[word]; bits != 0; bits &= bits - 1) {
+            u32 page = word * 64 + static_cast<u32>(__builtin_ctzll(bits));
+
+            /* The table keeps pointing at the page, which is now shared */
+            (*pages)[page] = std::move(this->owned[page]);
+        }
+    }
+
+    this->dirty = {};
+    this->baseline = std::move(pages);
+    return this->baseline;
+}
+
+void Memory::restore(const std::shared_ptr<const Pages>& pages) {
+    auto load = [this, &pages](u32 page) {
+        const Page* source = saved(pages, page);
+        this->pages[page] = source ? source->data() : zeroes.data();
+        this->owned[page] = nullptr;
+    };
+
+    if (pages == this->baseline) {
+        for (u32 word = 0; word < this->dirty.size(); word++) {
+            for (u64 bits = this->dirty[word]; bits != 0; bits &= bits - 1) {
+                load(word * 64 + static_cast<u32>(__builtin_ctzll(bits)));
+            }
+        }
+    }
+    else {
+        for (u32 page = 0; page < page_count; page++) {
+            if (this->is_dirty(static_cast<u8>(page)) || saved(pages, page) != saved(this->baseline, page)) {
+                load(page);
+            }
+        }
+    }
+
+    this->dirty = {};
+    this->baseline = pages;
+}
+
+bool Memory::operator==(const Memory& other) const {
+    for (u32 page = 0; page < page_count; page++) {
+        /* Pages read from the same place are the same */
+        if (this->pages[page] == other.pages[page]) {
+            continue;
+        }
+        if (std::memcmp(this->pages[page], other.pages[page], page_size) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const Memory::Page* Memory::saved(const std::shared_ptr<const Pages>& pages, u32 page) {
+    return pages ? (*pages)[page].get() : nullptr;
+}
+
+void Memory::claim(u8 page) {
+    auto copy = std::make_shared<Page>();
+    std::memcpy(copy->data(), this->pages[page], page_size);
+
+    this->pages[page] = copy->data();
+    this->owned[page] = std::move(copy);
+    this->dirty[page >> 6u] |= u64 { 1 } << (page & 0x3Fu);
+}
+
+void Memory::swap(Memory& other) noexcept {
+    std::swap(this->dirty, other.dirty);
+    std::swap(this->pages, other.pages);
+    std::swap(this->owned, other.owned);
+    std::swap(this->baseline, other.baseline);
+}
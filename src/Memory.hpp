@@ -0,0 +1,127 @@
+#pragma once
+
+#include <array>
+#include <memory>
+
+#include <typedefs.hpp>
+
+/* 64 KiB of data memory in 256-byte pages shared copy-on-write.
+ *
+ * Every page is read through a table pointing either at a page of this
+ * Memory's own or at an immutable page shared with snapshots and copies
+ * (or with nothing, for a page of zeroes). The first write to a shared
+ * page since the last snapshot() or restore() copies it and marks it
+ * dirty. snapshot() then takes the dirty pages over as they are, so taking
+ * and restoring snapshots and copying a Memory cost in proportion to the
+ * pages written, not to the 64 KiB.
+ *
+ * Writes must go through write(), reads through read() or operator[].
+ */
+class Memory {
+public:
+    static constexpr u32 size = 0x10000;
+    static constexpr u32 page_size = 0x100;
+    static constexpr u32 page_count = size / page_size;
+
+    using Page = std::array<u8, page_size>;
+
+    /* Saved contents of every page, nullptr for all zeroes */
+    using Pages = std::array<std::shared_ptr<const Page>, page_count>;
+
+    /* One bit per page, page `n` is bit `n % 64` of word `n / 64` */
+    using Bitmap = std::array<u64, page_count / 64>;
+
+    Memory();
+
+    /* Copies share every page but the dirty ones, which stay dirty */
+    Memory(const Memory& other);
+    Memory& operator=(const Memory& other);
+
+    /* Leaves `other` all zeroes */
+    Memory(Memory&& other) noexcept;
+    Memory& operator=(Memory&& other) noexcept;
+
+    u8 read(u16 addr) const {
+        return this->pages[addr >> 8u][addr & 0xFFu];
+    }
+
+    u8 operator[](u16 addr) const {
+        return this->read(addr);
+    }
+
+    /* Copies `count` bytes from `addr` on, which must not run past the end */
+    void read(u16 addr, u8* data, u32 count) const;
+
+    void write(u16 addr, u8 value) {
+        auto page = static_cast<u8>(addr >> 8u);
+        if (!this->is_dirty(page)) {
+            this->claim(page);
+        }
+        (*this->owned[page])[addr & 0xFFu] = value;
+    }
+
+    /* Dirty pages are those written since the last reset(), snapshot() or
+     * restore() */
+    bool is_dirty(u8 page) const {
+        return (this->dirty[page >> 6u] >> (page & 0x3Fu) & 1u) != 0;
+    }
+
+    const Bitmap& dirty_pages() const {
+        return this->dirty;
+    }
+
+    u32 dirty_count() const;
+
+    /* Whether `page` is known to be all zeroes, being neither dirty nor
+     * stored in the last snapshot */
+    bool is_blank(u8 page) const {
+        return !this->is_dirty(page) && saved(this->baseline, page) == nullptr;
+    }
+
+    /* The bytes of `page`, until it is next written or restored */
+    const u8* page(u8 page) const {
+        return this->pages[page];
+    }
+
+    /* Where each page is read from, for translated code. Dirty pages are
+     * this Memory's own, so it may write those in place too. */
+    const std::array<const u8*, page_count>& page_table() const {
+        return this->pages;
+    }
+
+    /* Zeroes every page that may be nonzero, leaving everything clean */
+    void reset();
+
+    /* Saves the current contents, handing the dirty pages over to the
+     * snapshot and sharing the rest with the previous one */
+    std::shared_ptr<const Pages> snapshot();
+
+    /* Brings back what snapshot() saved, for the pages that are dirty or
+     * differ between that snapshot and the last one taken or restored */
+    void restore(const std::shared_ptr<const Pages>& pages);
+
+    bool operator==(const Memory& other) const;
+    bool operator!=(const Memory& other) const {
+        return !(*this == other);
+    }
+
+private:
+    /* Saved page `page` of `pages`, nullptr when all zeroes */
+    static const Page* saved(const std::shared_ptr<const Pages>& pages, u32 page);
+
+    /* Gives `page` a copy of its own to write, marking it dirty */
+    void claim(u8 page);
+
+    void swap(Memory& other) noexcept;
+
+    /* Ahead of the table, so both are close to the rest of the Mcu */
+    Bitmap dirty {};
+
+    std::array<const u8*, page_count> pages;
+
+    /* The dirty pages, nullptr for the others */
+    std::array<std::shared_ptr<Page>, page_count> owned;
+
+    /* Snapshot the clean pages come from */
+    std::shared_ptr<const Pages> baseline;
+};
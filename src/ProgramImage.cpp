@@ -0,0 +1,80 @@
+#include <ProgramImage.hpp>
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <Jit.hpp>
+
+struct ProgramImage::Translations {
+    std::mutex mutex;
+    std::vector<std::pair<std::thread::id, std::shared_ptr<Jit>>> jits;
+};
+
+namespace {
+    /* Images the current thread translated, for dropping its translations
+     * when it exits */
+    struct ThreadTranslations {
+        std::vector<std::weak_ptr<ProgramImage::Translations>> images;
+
+        ~ThreadTranslations() {
+            auto thread = std::this_thread::get_id();
+
+            for (const auto& image : this->images) {
+                if (auto translations = image.lock()) {
+                    std::lock_guard<std::mutex> lock { translations->mutex };
+
+                    auto& jits = translations->jits;
+                    jits.erase(std::remove_if(jits.begin(), jits.end(), [thread](const auto& entry) {
+                        return entry.first == thread;
+                    }), jits.end());
+                }
+            }
+        }
+    };
+
+    thread_local ThreadTranslations thread_translations;
+}
+
+ProgramImage::ProgramImage(const std::vector<u8>& binary)
+    : jits { std::make_shared<Translations>() }
+{
+    std::copy_n(binary.begin(), std::min(binary.size(), this->program.size()), this->program.begin());
+
+    this->instructions.reserve(this->program.size());
+    for (u32 addr = 0; addr < this->program.size(); addr++) {
+        this->instructions.push_back(decode(this->program, static_cast<u16>(addr)));
+    }
+}
+
+std::shared_ptr<const ProgramImage> ProgramImage::create(const std::vector<u8>& binary) {
+    return std::make_shared<const ProgramImage>(binary);
+}
+
+const std::shared_ptr<const ProgramImage>& ProgramImage::empty() {
+    static const std::shared_ptr<const ProgramImage> image = create({});
+    return image;
+}
+
+std::shared_ptr<Jit> ProgramImage::translations(const McuBase& mcu) const {
+    std::lock_guard<std::mutex> lock { this->jits->mutex };
+
+    auto thread = std::this_thread::get_id();
+    for (const auto& [ owner, jit ] : this->jits->jits) {
+        if (owner == thread) {
+            return jit;
+        }
+    }
+
+    /* Forget images that are gone while at it */
+    auto& images = thread_translations.images;
+    images.erase(std::remove_if(images.begin(), images.end(), [](const auto& image) {
+        return image.expired();
+    }), images.end());
+    images.push_back(this->jits);
+
+    auto jit = std::make_shared<Jit>(mcu);
+    this->jits->jits.emplace_back(thread, jit);
+    return jit;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include <Instruction.hpp>
+#include <typedefs.hpp>
+
+class Jit;
+class McuBase;
+
+/* Read-only program memory and everything derived from it.
+ *
+ * An image never changes once built, so any number of Mcu instances can run
+ * the same ROM from one shared copy of its bytes and its decoded form. Each
+ * thread gets its own set of translations, shared by all instances it runs.
+ * The image lets go of a thread's translations when the thread exits, they
+ * are freed once no instance refers to them either.
+ */
+class ProgramImage {
+public:
+    /* Zero-padded to 64 KiB, anything past that is dropped */
+    explicit ProgramImage(const std::vector<u8>& binary);
+
+    ProgramImage(const ProgramImage&) = delete;
+    ProgramImage& operator=(const ProgramImage&) = delete;
+
+    static std::shared_ptr<const ProgramImage> create(const std::vector<u8>& binary);
+
+    /* Image of an all-zero program, what a fresh Mcu starts with */
+    static const std::shared_ptr<const ProgramImage>& empty();
+
+    const std::array<u8, 0x10000>& bytes() const {
+        return this->program;
+    }
+
+    /* Decoded form of the program, one entry per address */
+    const Instruction* decoded() const {
+        return this->instructions.data();
+    }
+
+    /* Translations for the calling thread, created on first use */
+    std::shared_ptr<Jit> translations(const McuBase& mcu) const;
+
+    /* Translations of every thread, also reachable from the threads that
+     * used the image so they can remove theirs on exit */
+    struct Translations;
+
+private:
+    std::array<u8, 0x10000> program {};
+    std::vector<Instruction> instructions;
+
+    std::shared_ptr<Translations> jits;
+};
@@ -0,0 +1,359 @@
+#include <SaveState.hpp>
+
+#include <algorithm>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <sstream>
+
+#include <fmt/format.h>
+
+#include <Mcu.hpp>
+#include <interrupts.hpp>
+#include <util.hpp>
+
+namespace {
+    constexpr SaveState::Tag magic { 'M', 'C', 'U', 'S' };
+    constexpr SaveState::Tag core_tag { 'C', 'O', 'R', 'E' };
+    constexpr SaveState::Tag memory_tag { 'M', 'E', 'M', ' ' };
+    constexpr SaveState::Tag end_tag { 'E', 'N', 'D', ' ' };
+
+    constexpr u32 core_size = 2 + 2 + 16 + 1 + 1 + 1 + 8 + 8;
+
+    /* Zero gaps shorter than a span header are cheaper to store inline */
+    constexpr u32 span_header_size = 4;
+    constexpr u32 max_span_size = 0xFFFF;
+
+    /* Calls `f(addr, size)` for each span covering the nonzero bytes */
+    template <typename F>
+    void for_each_span(const Memory& memory, F f) {
+        u32 addr = 0;
+
+        while (addr < Memory::size) {
+            if (addr % Memory::page_size == 0 && memory.is_blank(static_cast<u8>(addr / Memory::page_size))) {
+                addr += Memory::page_size;
+                continue;
+            }
+            if (memory[static_cast<u16>(addr)] == 0) {
+                addr++;
+                continue;
+            }
+
+            u32 start = addr;
+            u32 end = addr + 1;
+
+            for (addr = end; addr < Memory::size && addr - start < max_span_size && addr - end < span_header_size; addr++) {
+                if (addr % Memory::page_size == 0 && memory.is_blank(static_cast<u8>(addr / Memory::page_size))) {
+                    break;
+                }
+                if (memory[static_cast<u16>(addr)] != 0) {
+                    end = addr + 1;
+                }
+            }
+
+            f(static_cast<u16>(start), end - start);
+            addr = end;
+        }
+    }
+
+    /* Contents of a CORE chunk */
+    struct Core {
+        u16 pc;
+        u16 sp;
+        std::array<u8, 16> registers;
+        u8 flags;
+        u8 interrupts;
+        bool sleeping;
+        u64 cycles;
+        u64 instructions;
+    };
+
+    Core read_core(StateReader& reader, u32 size) {
+        if (size != core_size) {
+            throw save_state_error { "Malformed CORE chunk" };
+        }
+
+        Core core {};
+        core.pc = reader.read_u16();
+        core.sp = reader.read_u16();
+        reader.read(core.registers.data(), core.registers.size());
+        core.flags = reader.read_u8();
+        core.interrupts = reader.read_u8();
+        core.sleeping = reader.read_u8() != 0;
+        core.cycles = reader.read_u64();
+        core.instructions = reader.read_u64();
+
+        if ((core.interrupts & ~INTERRUPT_MASK) != 0) {
+            throw save_state_error { "Malformed CORE chunk" };
+        }
+        return core;
+    }
+
+    Memory read_memory(StateReader& reader, u32 size) {
+        Memory memory;
+
+        u8 page[Memory::page_size];
+        for (u32 left = size; left > 0; ) {
+            if (left < span_header_size) {
+                throw save_state_error { "Malformed MEM chunk" };
+            }
+
+            u32 addr = reader.read_u16();
+            u32 span = reader.read_u16();
+            if (span > left - span_header_size || addr + span > Memory::size) {
+                throw save_state_error { "Malformed MEM chunk" };
+            }
+            left -= span_header_size + span;
+
+            while (span > 0) {
+                u32 part = std::min<u32>(span, sizeof(page));
+                reader.read(page, part);
+                for (u32 i = 0; i < part; i++) {
+                    memory.write(static_cast<u16>(addr + i), page[i]);
+                }
+                addr += part;
+                span -= part;
+            }
+        }
+        return memory;
+    }
+
+    /* Reads `size` bytes a piece at a time, so that a bogus size runs into
+     * the end of the stream rather than into a huge allocation */
+    std::string read_payload(StateReader& reader, u32 size) {
+        constexpr size_t piece = 0x10000;
+
+        std::string payload;
+        while (payload.size() < size) {
+            size_t at = payload.size();
+            payload.resize(at + std::min<size_t>(size - at, piece));
+            reader.read(reinterpret_cast<u8*>(payload.data() + at), payload.size() - at);
+        }
+        return payload;
+    }
+
+    void write_tag(StateWriter& writer, const SaveState::Tag& tag) {
+        writer.write(reinterpret_cast<const u8*>(tag.data()), tag.size());
+    }
+
+    SaveState::Tag read_tag(StateReader& reader) {
+        SaveState::Tag tag {};
+        reader.read(reinterpret_cast<u8*>(tag.data()), tag.size());
+        return tag;
+    }
+}
+
+save_state_error::save_state_error(const std::string& what)
+    : std::runtime_error { what }
+{ }
+
+StateWriter::StateWriter(std::ostream& out)
+    : out { out }
+{ }
+
+void StateWriter::write_u8(u8 value) {
+    this->out.put(static_cast<char>(value));
+}
+
+void StateWriter::write_u16(u16 value) {
+    u8 bytes[2] = { low_byte(value), high_byte(value) };
+    this->write(bytes, sizeof(bytes));
+}
+
+void StateWriter::write_u32(u32 value) {
+    this->write_u16(static_cast<u16>(value & 0xFFFFu));
+    this->write_u16(static_cast<u16>(value >> 16u));
+}
+
+void StateWriter::write_u64(u64 value) {
+    this->write_u32(static_cast<u32>(value & 0xFFFFFFFFu));
+    this->write_u32(static_cast<u32>(value >> 32u));
+}
+
+void StateWriter::write(const u8* data, size_t size) {
+    this->out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+}
+
+StateReader::StateReader(std::istream& in)
+    : in { in }
+{ }
+
+u8 StateReader::read_u8() {
+    u8 value = 0;
+    this->read(&value, 1);
+    return value;
+}
+
+u16 StateReader::read_u16() {
+    u8 bytes[2] = {};
+    this->read(bytes, sizeof(bytes));
+    return static_cast<u16>(bytes[1] << 8u | bytes[0]);
+}
+
+u32 StateReader::read_u32() {
+    u32 low = this->read_u16();
+    u32 high = this->read_u16();
+    return high << 16u | low;
+}
+
+u64 StateReader::read_u64() {
+    u64 low = this->read_u32();
+    u64 high = this->read_u32();
+    return high << 32u | low;
+}
+
+void StateReader::read(u8* data, size_t size) {
+    if (!this->in.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(size))) {
+        throw save_state_error { "Save state ends early" };
+    }
+}
+
+void StateReader::skip(size_t size) {
+    if (!this->in.ignore(static_cast<std::streamsize>(size)) || this->in.gcount() != static_cast<std::streamsize>(size)) {
+        throw save_state_error { "Save state ends early" };
+    }
+}
+
+void SaveState::add_device(Tag tag, std::function<void(StateWriter&)> save, std::function<void(StateReader&)> load) {
+    this->devices.push_back(Device { tag, std::move(save), std::move(load) });
+}
+
+void SaveState::save(std::ostream& out, const McuBase& mcu) const {
+    StateWriter writer { out };
+
+    write_tag(writer, magic);
+    writer.write_u16(version);
+
+    /* Core */
+    write_tag(writer, core_tag);
+    writer.write_u32(core_size);
+    writer.write_u16(mcu.pc);
+    writer.write_u16(mcu.sp);
+    writer.write(mcu.registers.data(), mcu.registers.size());
+    writer.write_u8(static_cast<u8>(mcu.flags.carry << 0u | mcu.flags.zero << 1u | mcu.flags.interrupt << 2u));
+    writer.write_u8(mcu.interrupts.mask);
+    writer.write_u8(mcu.sleeping);
+    writer.write_u64(mcu.cycles);
+    writer.write_u64(mcu.instructions);
+
+    /* Memory, sized in a first pass so nothing needs buffering */
+    u32 memory_size = 0;
+    for_each_span(mcu.memory, [&memory_size](u16, u32 size) {
+        memory_size += span_header_size + size;
+    });
+
+    write_tag(writer, memory_tag);
+    writer.write_u32(memory_size);
+    for_each_span(mcu.memory, [&writer, &mcu](u16 addr, u32 size) {
+        writer.write_u16(addr);
+        writer.write_u16(static_cast<u16>(size));
+        for (u32 at = addr; at < addr + size;) {
+            u32 chunk = std::min(addr + size - at, Memory::page_size - at % Memory::page_size);
+            writer.write(mcu.memory.page(static_cast<u8>(at / Memory::page_size)) + at % Memory::page_size, chunk);
+            at += chunk;
+        }
+    });
+
+    /* Devices */
+    for (const Device& device : this->devices) {
+        std::ostringstream buffer;
+        StateWriter chunk { buffer };
+        device.save(chunk);
+
+        std::string payload = buffer.str();
+        write_tag(writer, device.tag);
+        writer.write_u32(static_cast<u32>(payload.size()));
+        writer.write(reinterpret_cast<const u8*>(payload.data()), payload.size());
+    }
+
+    write_tag(writer, end_tag);
+    writer.write_u32(0);
+}
+
+void SaveState::load(std::istream& in, McuBase& mcu) const {
+    StateReader reader { in };
+
+    if (read_tag(reader) != magic) {
+        throw save_state_error { "Not a save state" };
+    }
+    if (u16 found = reader.read_u16(); found != version) {
+        throw save_state_error { fmt::format("Unsupported save state version {}", found) };
+    }
+
+    std::optional<Core> core;
+    std::optional<Memory> memory;
+    std::vector<std::pair<const Device*, std::string>> payloads;
+
+    while (true) {
+        Tag tag = read_tag(reader);
+        u32 size = reader.read_u32();
+
+        if (tag == end_tag) {
+            break;
+        }
+
+        if (tag == core_tag) {
+            core = read_core(reader, size);
+            continue;
+        }
+
+        if (tag == memory_tag) {
+            memory = read_memory(reader, size);
+            continue;
+        }
+
+        auto device = std::find_if(this->devices.begin(), this->devices.end(), [&tag](const Device& device) {
+            return device.tag == tag;
+        });
+
+        if (device != this->devices.end()) {
+            payloads.emplace_back(&*device, read_payload(reader, size));
+        }
+        else {
+            reader.skip(size);
+        }
+    }
+
+    /* Devices check their chunks as they load them, put back the ones
+     * already loaded if one turns out malformed */
+    std::vector<std::pair<const Device*, std::string>> loaded;
+    try {
+        for (const auto& [ device, payload ] : payloads) {
+            std::ostringstream backup;
+            StateWriter writer { backup };
+            device->save(writer);
+
+            std::istringstream buffer { payload };
+            StateReader chunk { buffer };
+            device->load(chunk);
+
+            loaded.emplace_back(device, backup.str());
+        }
+    }
+    catch (const save_state_error&) {
+        for (auto it = loaded.rbegin(); it != loaded.rend(); ++it) {
+            std::istringstream buffer { it->second };
+            StateReader chunk { buffer };
+            it->first->load(chunk);
+        }
+        throw;
+    }
+
+    if (core) {
+        mcu.pc = core->pc;
+        mcu.sp = core->sp;
+        mcu.registers = core->registers;
+        mcu.flags.carry = (core->flags & 0x01u) != 0;
+        mcu.flags.zero = (core->flags & 0x02u) != 0;
+        mcu.flags.interrupt = (core->flags & 0x04u) != 0;
+        mcu.interrupts = {};
+        mcu.raise_interrupts(core->interrupts);
+        mcu.sleeping = core->sleeping;
+        mcu.cycles = core->cycles;
+        mcu.instructions = core->instructions;
+    }
+
+    if (memory) {
+        mcu.memory = std::move(*memory);
+    }
+}
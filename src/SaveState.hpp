@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <typedefs.hpp>
+
+class McuBase;
+
+class save_state_error : public std::runtime_error {
+public:
+    explicit save_state_error(const std::string& what);
+};
+
+/* Little-endian primitives on top of a stream */
+class StateWriter {
+public:
+    explicit StateWriter(std::ostream& out);
+
+    void write_u8(u8 value);
+    void write_u16(u16 value);
+    void write_u32(u32 value);
+    void write_u64(u64 value);
+    void write(const u8* data, size_t size);
+
+private:
+    std::ostream& out;
+};
+
+class StateReader {
+public:
+    explicit StateReader(std::istream& in);
+
+    /* All of these throw save_state_error when the stream runs dry */
+    u8 read_u8();
+    u16 read_u16();
+    u32 read_u32();
+    u64 read_u64();
+    void read(u8* data, size_t size);
+    void skip(size_t size);
+
+private:
+    std::istream& in;
+};
+
+/* Versioned save-state format.
+ *
+ *   header   "MCUS", u16 version
+ *   chunks   4-byte tag, u32 payload size, payload
+ *   end      "END ", 0
+ *
+ * "CORE" holds the registers, flags, pending interrupts, sleep state and
+ * counters, "MEM " the data memory as a list of nonzero spans (u16 address,
+ * u16 size, bytes), so mostly empty memory takes a few bytes per span. Other
+ * chunks belong to devices registered with add_device(), such as "UART",
+ * "DISP" and "BTNS" from Serial, Display and Buttons::add_to(); chunks
+ * nobody claims are skipped when loading. The program image is not part of
+ * the state, load the same program before loading a state.
+ *
+ * Saving streams, buffering device chunks one at a time to learn their
+ * size. Loading buffers the whole state, memory included, to check it
+ * before applying it.
+ */
+class SaveState {
+public:
+    static constexpr u16 version = 1;
+
+    using Tag = std::array<char, 4>;
+
+    /* Saves and restores the state of a device under `tag` */
+    void add_device(Tag tag, std::function<void(StateWriter&)> save, std::function<void(StateReader&)> load);
+
+    void save(std::ostream& out, const McuBase& mcu) const;
+
+    /* Reads the whole state before applying any of it. Throws
+     * save_state_error, leaving `mcu` and the devices as they were, if the
+     * stream is not a save state of a known version, ends early or holds a
+     * malformed chunk. */
+    void load(std::istream& in, McuBase& mcu) const;
+
+private:
+    struct Device {
+        Tag tag;
+        std::function<void(StateWriter&)> save;
+        std::function<void(StateReader&)> load;
+    };
+
+    std::vector<Device> devices;
+};
@@ -0,0 +1,78 @@
+#include <Scheduler.hpp>
+
+#include <algorithm>
+
+Scheduler::EventId Scheduler::schedule(u64 cycle, Callback callback) {
+    EventId id = this->next_id++;
+
+    this->events.push_back(Event { cycle, id, std::move(callback) });
+    std::push_heap(this->events.begin(), this->events.end(), later);
+
+    return id;
+}
+
+Scheduler::EventId Scheduler::watch(Callback callback) {
+    EventId id = this->next_id++;
+    this->watches.push_back(Watch { id, std::move(callback) });
+    return id;
+}
+
+bool Scheduler::cancel(EventId id) {
+    auto watch = std::find_if(this->watches.begin(), this->watches.end(), [id](const Watch& watch) {
+        return watch.id == id;
+    });
+    if (watch != this->watches.end()) {
+        this->watches.erase(watch);
+        return true;
+    }
+
+    bool pending = std::any_of(this->events.begin(), this->events.end(), [id](const Event& event) {
+        return event.id == id;
+    });
+
+    if (!pending || !this->cancelled.insert(id).second) {
+        return false;
+    }
+
+    this->prune();
+    return true;
+}
+
+u64 Scheduler::next_deadline() {
+    this->prune();
+    return this->events.empty() ? never : this->events.front().cycle;
+}
+
+void Scheduler::run_due(u64 now) {
+    /* By index, a watch may add another */
+    for (size_t i = 0; i < this->watches.size(); i++) {
+        this->watches[i].callback(now);
+    }
+
+    while (this->next_deadline() <= now) {
+        std::pop_heap(this->events.begin(), this->events.end(), later);
+        Event event = std::move(this->events.back());
+        this->events.pop_back();
+
+        event.callback(event.cycle);
+    }
+}
+
+void Scheduler::clear() {
+    this->events.clear();
+    this->cancelled.clear();
+    this->watches.clear();
+}
+
+bool Scheduler::later(const Event& a, const Event& b) {
+    return a.cycle != b.cycle ? a.cycle > b.cycle : a.id > b.id;
+}
+
+void Scheduler::prune() {
+    while (!this->events.empty() && this->cancelled.count(this->events.front().id) != 0) {
+        this->cancelled.erase(this->events.front().id);
+
+        std::pop_heap(this->events.begin(), this->events.end(), later);
+        this->events.pop_back();
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+#include <typedefs.hpp>
+
+/* Callbacks keyed on emulated time, in cycles.
+ *
+ * run() executes straight up to the next deadline, then runs what is due
+ * before continuing, so an event fires after the instruction that reaches
+ * its cycle. Events due at the same cycle run in the order they were
+ * scheduled. A callback gets the cycle it was scheduled for, which keeps
+ * periodic events from drifting when it reschedules itself.
+ *
+ * Events are host state: snapshots do not carry them, fork() copies them
+ * as they are but for those of devices, which stay with the parent.
+ */
+class Scheduler {
+public:
+    using Callback = std::function<void(u64 cycle)>;
+    using EventId = u64;
+
+    static constexpr u64 never = UINT64_MAX;
+
+    /* Schedules `callback` at absolute cycle `cycle`, a cycle already past
+     * fires as soon as the run loop gets to it */
+    EventId schedule(u64 cycle, Callback callback);
+
+    /* Calls `callback` with the current cycle every time run_due() runs, at
+     * least at the start of every run() and at every deadline. For devices
+     * fed by other threads, which keep nothing scheduled while idle and
+     * look for new input here instead. Cancelled like an event. */
+    EventId watch(Callback callback);
+
+    /* Returns false if the event already fired or was cancelled */
+    bool cancel(EventId id);
+
+    /* Cycle of the next event, or `never` */
+    u64 next_deadline();
+
+    /* Calls the watches, then runs every event due by `now`, including ones
+     * scheduled on the way */
+    void run_due(u64 now);
+
+    size_t size() const {
+        return this->events.size() - this->cancelled.size();
+    }
+
+    /* Drops every event and watch */
+    void clear();
+
+private:
+    struct Event {
+        u64 cycle;
+        EventId id;
+        Callback callback;
+    };
+
+    struct Watch {
+        EventId id;
+        Callback callback;
+    };
+
+    /* Ordering of the min-heap in `events` */
+    static bool later(const Event& a, const Event& b);
+
+    /* Drops cancelled events off the top of the heap */
+    void prune();
+
+    std::vector<Event> events;
+    std::unordered_set<EventId> cancelled;
+
+    std::vector<Watch> watches;
+
+    /* Ids only grow, so they also order events on the same cycle */
+    EventId next_id = 0;
+};
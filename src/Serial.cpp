@@ -0,0 +1,241 @@
+#include <Serial.hpp>
+
+#include <algorithm>
+
+#include <interrupts.hpp>
+
+namespace {
+    void write_fifo(StateWriter& writer, const std::deque<u8>& fifo) {
+        writer.write_u8(static_cast<u8>(fifo.size()));
+        for (u8 value : fifo) {
+            writer.write_u8(value);
+        }
+    }
+
+    std::deque<u8> read_fifo(StateReader& reader) {
+        u8 size = reader.read_u8();
+        if (size > Serial::fifo_size) {
+            throw save_state_error { "Malformed serial port chunk" };
+        }
+
+        std::deque<u8> fifo(size);
+        for (u8& value : fifo) {
+            value = reader.read_u8();
+        }
+        return fifo;
+    }
+}
+
+Serial::Serial(Mcu& mcu, u8 base, u32 cycles_per_byte, size_t ring_size)
+    : Attachment { mcu }
+    , input { ring_size }
+    , output { ring_size }
+    , mcu { mcu }
+    , base { base }
+    , cycles_per_byte { std::max<u32>(cycles_per_byte, 1) }
+{
+    this->mcu.io_handlers[base] = IoHandler {
+        .get = [this]() {
+            if (this->rx.empty()) {
+                return u8 { 0x00 };
+            }
+            u8 value = this->rx.front();
+            this->rx.pop_front();
+            this->listen(this->mcu.cycles);
+            return value;
+        },
+        .set = [this](u8 value) {
+            if (this->tx.size() >= fifo_size) {
+                return;
+            }
+            this->tx.push_back(value);
+
+            if (this->tx_cycle == Scheduler::never) {
+                this->tx_cycle = this->mcu.cycles + this->cycles_per_byte;
+                this->tx_event = this->mcu.scheduler.schedule(this->tx_cycle, [this](u64 cycle) {
+                    this->transmit(cycle);
+                });
+            }
+        },
+    };
+
+    this->mcu.io_handlers[static_cast<u8>(base + 1)] = IoHandler {
+        .get = [this]() {
+            return this->status();
+        },
+        .set = [this](u8 value) {
+            u8 enabled = value & ~this->control;
+            this->control = value & (SERIAL_RX_INTERRUPT | SERIAL_TX_INTERRUPT);
+
+            if ((enabled & SERIAL_RX_INTERRUPT) != 0 && !this->rx.empty()) {
+                this->raise(SERIAL_RX_INTERRUPT);
+            }
+            if ((enabled & SERIAL_TX_INTERRUPT) != 0 && this->tx.empty()) {
+                this->raise(SERIAL_TX_INTERRUPT);
+            }
+        },
+        .pure = true,
+    };
+
+    this->watch = this->mcu.scheduler.watch([this](u64 cycle) {
+        this->listen(cycle);
+    });
+}
+
+Serial::Serial(Mcu& mcu, const Serial& other)
+    : Serial { mcu, other.base, other.cycles_per_byte, other.input.capacity() }
+{
+    this->control = other.control;
+    this->rx = other.rx;
+    this->tx = other.tx;
+    this->rx_cycle = other.rx_cycle;
+    this->tx_cycle = other.tx_cycle;
+    this->resume();
+}
+
+Serial::~Serial() {
+    this->mcu.scheduler.cancel(this->watch);
+    if (this->rx_cycle != Scheduler::never) {
+        this->mcu.scheduler.cancel(this->rx_event);
+    }
+    if (this->tx_cycle != Scheduler::never) {
+        this->mcu.scheduler.cancel(this->tx_event);
+    }
+
+    this->mcu.io_handlers.erase(this->base);
+    this->mcu.io_handlers.erase(static_cast<u8>(this->base + 1));
+}
+
+u8 Serial::status() const {
+    u8 status = 0;
+    if (!this->rx.empty()) {
+        status |= SERIAL_RX_READY;
+    }
+    if (this->tx.size() < fifo_size) {
+        status |= SERIAL_TX_READY;
+    }
+    if (this->tx.empty()) {
+        status |= SERIAL_TX_IDLE;
+    }
+    return status;
+}
+
+void Serial::add_to(SaveState& state, SaveState::Tag tag) {
+    state.add_device(tag,
+        [this](StateWriter& writer) { this->save(writer); },
+        [this](StateReader& reader) { this->load(reader); }
+    );
+}
+
+void Serial::leave(McuBase& fork) const {
+    /* Attached to an Mcu, so its forks are Mcus too */
+    Mcu& copy = static_cast<Mcu&>(fork);
+
+    copy.scheduler.cancel(this->watch);
+    if (this->rx_cycle != Scheduler::never) {
+        copy.scheduler.cancel(this->rx_event);
+    }
+    if (this->tx_cycle != Scheduler::never) {
+        copy.scheduler.cancel(this->tx_event);
+    }
+
+    copy.io_handlers.erase(this->base);
+    copy.io_handlers.erase(static_cast<u8>(this->base + 1));
+}
+
+void Serial::listen(u64 cycle) {
+    if (this->rx_cycle != Scheduler::never || this->rx.size() >= fifo_size || this->input.empty()) {
+        return;
+    }
+
+    this->rx_cycle = cycle + this->cycles_per_byte;
+    this->rx_event = this->mcu.scheduler.schedule(this->rx_cycle, [this](u64 cycle) {
+        this->receive(cycle);
+    });
+}
+
+void Serial::receive(u64 cycle) {
+    this->rx_cycle = Scheduler::never;
+
+    u8 value = 0;
+    if (this->rx.size() < fifo_size && this->input.pop(value)) {
+        this->rx.push_back(value);
+        this->raise(SERIAL_RX_INTERRUPT);
+    }
+
+    /* Back to back while input keeps coming, a full FIFO waits for the
+     * program to read */
+    this->listen(cycle);
+}
+
+void Serial::transmit(u64 cycle) {
+    /* The host not keeping up holds the line */
+    if (this->output.push(this->tx.front())) {
+        this->tx.pop_front();
+    }
+
+    if (this->tx.empty()) {
+        this->tx_cycle = Scheduler::never;
+        this->raise(SERIAL_TX_INTERRUPT);
+        return;
+    }
+
+    this->tx_cycle = cycle + this->cycles_per_byte;
+    this->tx_event = this->mcu.scheduler.schedule(this->tx_cycle, [this](u64 cycle) {
+        this->transmit(cycle);
+    });
+}
+
+void Serial::resume() {
+    if (this->rx_cycle != Scheduler::never) {
+        this->rx_event = this->mcu.scheduler.schedule(this->rx_cycle, [this](u64 cycle) {
+            this->receive(cycle);
+        });
+    }
+    if (this->tx_cycle != Scheduler::never) {
+        this->tx_event = this->mcu.scheduler.schedule(this->tx_cycle, [this](u64 cycle) {
+            this->transmit(cycle);
+        });
+    }
+}
+
+void Serial::raise(u8 condition) {
+    if ((this->control & condition) != 0) {
+        this->mcu.raise_interrupts(1u << SERIAL_INTERRUPT);
+    }
+}
+
+void Serial::save(StateWriter& writer) const {
+    writer.write_u8(this->control);
+    write_fifo(writer, this->rx);
+    write_fifo(writer, this->tx);
+    writer.write_u64(this->rx_cycle);
+    writer.write_u64(this->tx_cycle);
+}
+
+void Serial::load(StateReader& reader) {
+    u8 control = reader.read_u8();
+    std::deque<u8> rx = read_fifo(reader);
+    std::deque<u8> tx = read_fifo(reader);
+    u64 rx_cycle = reader.read_u64();
+    u64 tx_cycle = reader.read_u64();
+
+    /* The transmitter runs exactly while it has something to send */
+    if (tx.empty() != (tx_cycle == Scheduler::never)) {
+        throw save_state_error { "Malformed serial port chunk" };
+    }
+
+    if (this->rx_cycle != Scheduler::never) {
+        this->mcu.scheduler.cancel(this->rx_event);
+    }
+    if (this->tx_cycle != Scheduler::never) {
+        this->mcu.scheduler.cancel(this->tx_event);
+    }
+
+    this->control = control & (SERIAL_RX_INTERRUPT | SERIAL_TX_INTERRUPT);
+    this->rx = std::move(rx);
+    this->tx = std::move(tx);
+    this->rx_cycle = rx_cycle;
+    this->tx_cycle = tx_cycle;
+    this->resume();
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <deque>
+
+#include <Attachment.hpp>
+#include <ByteRing.hpp>
+#include <Mcu.hpp>
+#include <SaveState.hpp>
+#include <Scheduler.hpp>
+#include <typedefs.hpp>
+
+/* Bits read from the status port */
+#define SERIAL_RX_READY     0x01    /* A received byte is waiting */
+#define SERIAL_TX_READY     0x02    /* The transmit FIFO has room */
+#define SERIAL_TX_IDLE      0x04    /* Everything written has been sent */
+
+/* Bits written to the status port */
+#define SERIAL_RX_INTERRUPT 0x01    /* Interrupt when a byte arrives */
+#define SERIAL_TX_INTERRUPT 0x02    /* Interrupt when the transmitter goes idle */
+
+/* UART on two ports of an Mcu: data at `base`, status and control at
+ * `base + 1`.
+ *
+ * The line moves one byte each way every `cycles_per_byte` cycles, driven
+ * by scheduler events that only run while there is something to move. A
+ * byte from `input` lands in the receive FIFO, a byte written to the data
+ * port leaves the transmit FIFO for `output` once sent. Nothing is lost:
+ * the receiver leaves bytes in `input` while its FIFO is full, the
+ * transmitter waits while `output` is, and writes to a full transmit FIFO
+ * are dropped, check SERIAL_TX_READY first. Reading the data port with
+ * nothing received gives 0x00.
+ *
+ * SERIAL_INTERRUPT is raised when a byte arrives or the transmitter goes
+ * idle, if enabled, and when enabling either while its condition holds.
+ *
+ * The host writes `input` and reads `output`, each from any one thread.
+ * An idle receiver looks for input whenever the scheduler runs due events
+ * (see Scheduler::watch()), so input arriving while the Mcu sleeps with
+ * nothing scheduled is picked up on its next run(). The status port only
+ * changes at events, so loops polling it are skipped up to the next one.
+ */
+class Serial : public Attachment {
+public:
+    static constexpr size_t fifo_size = 16;
+
+    Serial(Mcu& mcu, u8 base, u32 cycles_per_byte, size_t ring_size = 0x10000);
+
+    /* Attaches a copy of `other` to `mcu`, usually a fork of the Mcu `other`
+     * is attached to, with the same FIFOs and control bits and the line at
+     * the same point in each byte. `input` and `output` start empty, a byte
+     * being received is taken from the copy's own `input` as it lands. */
+    Serial(Mcu& mcu, const Serial& other);
+
+    ~Serial() override;
+
+    Serial(const Serial&) = delete;
+    Serial& operator=(const Serial&) = delete;
+
+    u8 status() const;
+
+    /* Saves and restores the FIFOs, the control bits and where the line is
+     * in each byte with `state` under `tag`. `input` and `output` belong to
+     * the host and are not part of it. */
+    void add_to(SaveState& state, SaveState::Tag tag = { 'U', 'A', 'R', 'T' });
+
+    void leave(McuBase& fork) const override;
+
+    ByteRing input;
+    ByteRing output;
+
+private:
+    /* Starts receiving if input is waiting and the FIFO has room */
+    void listen(u64 cycle);
+
+    void receive(u64 cycle);
+    void transmit(u64 cycle);
+
+    /* Schedules the bytes on the line at `rx_cycle` and `tx_cycle` */
+    void resume();
+
+    /* Raises the interrupt if `condition` is enabled */
+    void raise(u8 condition);
+
+    void save(StateWriter& writer) const;
+
+    /* Throws save_state_error, leaving the port as it was, if the chunk
+     * does not hold a valid state */
+    void load(StateReader& reader);
+
+    Mcu& mcu;
+    u8 base;
+    u32 cycles_per_byte;
+
+    std::deque<u8> rx;
+    std::deque<u8> tx;
+    u8 control = 0;
+
+    Scheduler::EventId rx_event = 0;
+    Scheduler::EventId tx_event = 0;
+
+    /* Cycle of the next byte each way, `never` while idle */
+    u64 rx_cycle = Scheduler::never;
+    u64 tx_cycle = Scheduler::never;
+
+    Scheduler::EventId watch = 0;
+};
@@ -0,0 +1,194 @@
+#include <TimeTravel.hpp>
+
+#include <algorithm>
+
+TimeTravel::TimeTravel(Mcu& mcu, u64 interval, size_t capacity)
+    : Attachment { mcu }
+    , mcu { mcu }
+    , journal { mcu }
+    , interval { std::max<u64>(interval, 1) }
+    , capacity { std::max<size_t>(capacity, 1) }
+{
+    this->mcu.tap = &this->journal;
+    this->mcu.hold_requests = true;
+    this->mcu.hold_events = true;
+    this->horizon = this->mcu.cycles;
+    this->seen = this->mcu.pending_interrupts();
+    this->checkpoint();
+}
+
+TimeTravel::~TimeTravel() {
+    this->mcu.tap = nullptr;
+    this->mcu.hold_requests = false;
+    this->mcu.hold_events = false;
+    this->mcu.raise_interrupts(this->mcu.release_requests());
+}
+
+Mcu::RunResult TimeTravel::run(u64 budget) {
+    const u64 start_cycles = this->mcu.cycles;
+    const u64 start_instructions = this->mcu.instructions;
+    const u64 deadline = this->mcu.cycles + std::min(budget, UINT64_MAX - this->mcu.cycles);
+
+    if (this->mcu.cycles >= this->horizon) {
+        if (u8 raised = this->mcu.pending_interrupts() & ~this->seen) {
+            this->journal.record_host_raise(raised);
+        }
+    }
+
+    Mcu::StopReason reason = Mcu::StopReason::Budget;
+
+    while (this->mcu.cycles < deadline) {
+        u64 limit = deadline;
+
+        if (this->mcu.cycles < this->horizon) {
+            this->journal.replaying = true;
+            limit = std::min({ limit, this->horizon, this->journal.replay_host_raises() });
+        }
+        else {
+            this->journal.replaying = false;
+
+            /* Take requests from other threads and run device events here
+             * rather than in Mcu::run(), which returns whenever one is due,
+             * to see what they raise, replaying gets it from the journal
+             * instead */
+            u8 pending = this->mcu.pending_interrupts();
+            this->mcu.raise_interrupts(this->mcu.release_requests());
+            this->mcu.scheduler.run_due(this->mcu.cycles);
+            if (u8 raised = this->mcu.pending_interrupts() & ~pending) {
+                this->journal.record_host_raise(raised);
+            }
+
+            limit = std::min({ limit, this->checkpoints.back().snapshot.cycles + this->interval, this->mcu.scheduler.next_deadline() });
+        }
+
+        auto result = this->mcu.run(limit - this->mcu.cycles);
+
+        if (!this->journal.replaying && this->mcu.cycles >= this->checkpoints.back().snapshot.cycles + this->interval) {
+            this->checkpoint();
+        }
+
+        if (result.reason != Mcu::StopReason::Budget) {
+            reason = result.reason;
+            break;
+        }
+    }
+
+    if (this->mcu.cycles >= this->horizon) {
+        this->journal.replaying = false;
+        this->horizon = this->mcu.cycles;
+    }
+    this->seen = this->mcu.pending_interrupts();
+
+    return Mcu::RunResult {
+        .instructions = this->mcu.instructions - start_instructions,
+        .cycles = this->mcu.cycles - start_cycles,
+        .reason = reason,
+    };
+}
+
+bool TimeTravel::reverse_step(u64 count) {
+    if (count > this->mcu.instructions || this->mcu.instructions - count < this->oldest_instruction()) {
+        return false;
+    }
+
+    u64 target = this->mcu.instructions - count;
+
+    auto it = std::find_if(this->checkpoints.rbegin(), this->checkpoints.rend(), [target](const Checkpoint& checkpoint) {
+        return checkpoint.snapshot.instructions <= target;
+    });
+
+    this->go_back(*it);
+    this->replay_to(target);
+    return true;
+}
+
+bool TimeTravel::reverse_continue(const std::function<bool(const McuBase&)>& condition) {
+    u64 now = this->mcu.instructions;
+
+    for (size_t i = this->checkpoints.size(); i-- > 0; ) {
+        const Checkpoint& checkpoint = this->checkpoints[i];
+        if (checkpoint.snapshot.instructions >= now) {
+            continue;
+        }
+
+        /* Look for the last hit between this checkpoint and the next one */
+        u64 end = i + 1 < this->checkpoints.size() ? std::min(now, this->checkpoints[i + 1].snapshot.instructions) : now;
+
+        this->go_back(checkpoint);
+
+        bool found = false;
+        u64 hit = 0;
+        while (this->mcu.instructions < end) {
+            if (condition(this->mcu)) {
+                found = true;
+                hit = this->mcu.instructions;
+            }
+            u64 before = this->mcu.instructions;
+            this->replay_to(before + 1);
+            if (this->mcu.instructions == before) {
+                break;
+            }
+        }
+
+        if (found) {
+            this->go_back(checkpoint);
+            this->replay_to(hit);
+            return true;
+        }
+    }
+
+    this->go_back(this->checkpoints.front());
+    return false;
+}
+
+u64 TimeTravel::oldest_instruction() const {
+    return this->checkpoints.front().snapshot.instructions;
+}
+
+void TimeTravel::leave(McuBase& fork) const {
+    /* Attached to an Mcu, so its forks are Mcus too */
+    Mcu& copy = static_cast<Mcu&>(fork);
+
+    copy.tap = nullptr;
+    copy.hold_requests = false;
+    copy.hold_events = false;
+    copy.raise_interrupts(copy.release_requests());
+}
+
+void TimeTravel::checkpoint() {
+    if (this->checkpoints.size() == this->capacity) {
+        this->checkpoints.pop_front();
+        this->journal.discard_before(this->checkpoints.front().position);
+    }
+
+    this->checkpoints.push_back(Checkpoint {
+        .snapshot = this->mcu.snapshot(),
+        .position = this->journal.position(),
+    });
+}
+
+void TimeTravel::go_back(const Checkpoint& checkpoint) {
+    this->horizon = std::max(this->horizon, this->mcu.cycles);
+    this->mcu.restore(checkpoint.snapshot);
+    this->journal.seek(checkpoint.position);
+    this->journal.replaying = true;
+}
+
+void TimeTravel::replay_to(u64 instructions) {
+    while (this->mcu.instructions < instructions && this->mcu.cycles < this->horizon) {
+        u64 limit = std::min(this->horizon, this->journal.replay_host_raises());
+        u64 budget = limit - this->mcu.cycles;
+
+        /* Every instruction takes at least a cycle, so this cannot overshoot.
+         * Sleeping takes no instructions, sleep through to the next host
+         * raise. */
+        if (!this->mcu.sleeping || this->mcu.interrupt_due()) {
+            budget = std::min(budget, instructions - this->mcu.instructions);
+        }
+
+        if (this->mcu.run(budget).cycles == 0) {
+            break;
+        }
+    }
+    this->seen = this->mcu.pending_interrupts();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+
+#include <Attachment.hpp>
+#include <IoJournal.hpp>
+#include <Mcu.hpp>
+#include <typedefs.hpp>
+
+/* Reverse execution for an Mcu.
+ *
+ * Runs through run() are recorded: a snapshot is taken every `interval`
+ * cycles, keeping the last `capacity` of them, and all port accesses and
+ * interrupts raised by the host between runs go through an IoJournal.
+ * Going back restores the nearest earlier checkpoint and re-executes from
+ * there with the journal replaying, so no handler runs twice. Running
+ * forward from the past replays up to where recording stopped, then
+ * continues live.
+ *
+ * Interrupts raised by scheduled device events or requested by other
+ * threads are recorded like those the host raises, requests being held
+ * until recording catches up with the present. Events are not rewound:
+ * they run once, live, and replay only sees their interrupts. Host changes
+ * other than raising interrupts, like poking registers between runs, are
+ * not recorded.
+ *
+ * Going forward costs a snapshot per interval, then a copy of each page as
+ * it is first written (see Memory), and a journal entry per port access.
+ * Idle and poll loops are skipped as without recording, a skipped poll loop
+ * taking one entry, so emulator_bench runs the JIT with recording within a
+ * few percent of without, polling or not.
+ */
+class TimeTravel : public Attachment {
+public:
+    explicit TimeTravel(Mcu& mcu, u64 interval = 1'000'000, size_t capacity = 32);
+    ~TimeTravel() override;
+
+    TimeTravel(const TimeTravel&) = delete;
+    TimeTravel& operator=(const TimeTravel&) = delete;
+
+    /* Mcu::run() with recording */
+    Mcu::RunResult run(u64 budget);
+
+    /* Goes back `count` instructions. Returns false, staying put, if that is
+     * further back than the oldest checkpoint. */
+    bool reverse_step(u64 count = 1);
+
+    /* Goes back to the last instruction boundary before now at which
+     * `condition` held. Returns false, at the oldest checkpoint, if there is
+     * none. */
+    bool reverse_continue(const std::function<bool(const McuBase&)>& condition);
+
+    /* Earliest instruction count reverse_step() can reach */
+    u64 oldest_instruction() const;
+
+    /* Forks run unrecorded */
+    void leave(McuBase& fork) const override;
+
+private:
+    struct Checkpoint {
+        McuBase::Snapshot snapshot;
+        IoJournal::Position position;
+    };
+
+    void checkpoint();
+    void go_back(const Checkpoint& checkpoint);
+
+    /* Replays until `instructions` have been executed or the recording ends */
+    void replay_to(u64 instructions);
+
+    Mcu& mcu;
+    IoJournal journal;
+
+    u64 interval;
+    size_t capacity;
+    std::deque<Checkpoint> checkpoints;
+
+    /* Cycle recording stopped at, replay runs up to here */
+    u64 horizon = 0;
+
+    /* Pending interrupts after the last run, to tell what the host raised */
+    u8 seen = 0;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <array>
+
+#include <opcodes.hpp>
+#include <typedefs.hpp>
+
+/* Extra cycles a conditional branch takes when taken */
+#define BRANCH_TAKEN_CYCLES 1
+
+/* Cycles from accepting an interrupt to the first instruction of its
+ * handler: pushing pc and jumping to the vector */
+#define INTERRUPT_CYCLES    4
+
+/* Cycles each opcode takes, conditional branches when not taken. Illegal
+ * opcodes take one. */
+constexpr std::array<u8, 0x100> opcode_cycles = [] {
+    std::array<u8, 0x100> cycles {};
+    for (u8& c : cycles) {
+        c = 1;
+    }
+
+    cycles[JMP]  = 2;
+    cycles[CALL] = 3;
+    cycles[RET]  = 4;
+    cycles[RETI] = 4;
+
+    cycles[LD]   = 2;
+    cycles[ST]   = 2;
+    cycles[PUSH] = 2;
+    cycles[POP]  = 2;
+    cycles[LPM]  = 3;
+
+    return cycles;
+}();
+
+/* Cycles a branch instruction takes */
+constexpr u32 branch_cycles(u8 opcode, bool taken) {
+    bool conditional = opcode == BRC || opcode == BRNC || opcode == BRZ || opcode == BRNZ;
+    return opcode_cycles[opcode] + (taken && conditional ? BRANCH_TAKEN_CYCLES : 0);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+/* Synthetic dispatch targets the decoder uses in place of an opcode, see
+ * Instruction::handler. Chosen from the unused opcode space, which is safe
+ * because illegal opcodes never keep their own number as their handler. */
+
+#define ILLEGAL   0xFF  /* Every byte that is not an opcode */
+
+#define IDLE_LOOP 0x40  /* Branch closing a loop that can only spin until an external event */
+
+/* Compare or decrement fused with the conditional branch right after it. The
+ * record describes the first instruction, `target` is the branch target. */
+#define CP_BRZ    0x41
+#define CP_BRNZ   0x42
+#define CPI_BRZ   0x43
+#define CPI_BRNZ  0x44
+#define DEC_BRNZ  0x45
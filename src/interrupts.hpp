@@ -1,5 +1,24 @@
 #pragma once
 
+#include <typedefs.hpp>
+
 #define VBLANK_VECTOR   0x10
 #define BUTTON_VECTOR   0x20
 #define SERIAL_VECTOR   0x40
+
+/* Bits of the pending interrupt mask, the lowest pending one is taken first */
+#define VBLANK_INTERRUPT    0
+#define BUTTON_INTERRUPT    1
+#define SERIAL_INTERRUPT    2
+
+#define INTERRUPT_SOURCES   3
+
+/* Every bit that has a source */
+#define INTERRUPT_MASK      ((1u << INTERRUPT_SOURCES) - 1)
+
+/* Vector of each interrupt, by bit */
+constexpr u16 interrupt_vectors[INTERRUPT_SOURCES] = {
+    VBLANK_VECTOR,
+    BUTTON_VECTOR,
+    SERIAL_VECTOR,
+};
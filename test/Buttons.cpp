@@ -0,0 +1,141 @@
+#include "catch.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <Buttons.hpp>
+#include <Mcu.hpp>
+#include <SaveState.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+#include "programs.hpp"
+
+TEST_CASE("Buttons") {
+    /* Logs the state at each interrupt to 0x4000 onwards */
+    std::vector<u8> program = program_with({
+        { 0x00, { JMP, 0x00, 0x50 } },
+        { BUTTON_VECTOR, {
+            IN,  0x00, 0x05,
+            ST,  0x00,
+            INC, 0x0D,
+            RETI,
+        } },
+        { 0x50, {
+            LDI, 0x0C, 0x40,
+            LDI, 0x0D, 0x00,
+            SEI,
+            SLEEP,
+            JMP, 0x00, 0x57,
+        } },
+    });
+
+    auto mcu = std::make_unique<Mcu>();
+    mcu->engine = Mcu::Engine::Jit;
+    mcu->load_program(program);
+
+    Buttons buttons { *mcu, 0x05 };
+    REQUIRE_THROWS_AS(buttons.queue({ 10, 8, true }), std::invalid_argument);
+
+    /* Out of order on purpose, the two at 250 apply together */
+    buttons.queue({
+        { 250, 1, true },
+        { 100, 0, true },
+        { 1000, 1, false },
+        { 250, 0, false },
+    });
+    REQUIRE(buttons.queued() == 4);
+
+    mcu->run(100);
+    REQUIRE(buttons.state() == 0x00);
+    REQUIRE(mcu->cycles == 100);
+
+    mcu->run(1);
+    REQUIRE(buttons.state() == 0x01);
+
+    mcu->run(1000);
+    REQUIRE(buttons.state() == 0x00);
+    REQUIRE(buttons.queued() == 0);
+    REQUIRE(mcu->registers[13] == 3);
+    REQUIRE(mcu->memory[0x4000] == 0x01);
+    REQUIRE(mcu->memory[0x4001] == 0x02);
+    REQUIRE(mcu->memory[0x4002] == 0x00);
+
+    /* Already past, applies right away */
+    buttons.queue({ 0, 7, true });
+    mcu->run(10);
+    REQUIRE(buttons.state() == 0x80);
+    REQUIRE(mcu->memory[0x4003] == 0x80);
+}
+
+TEST_CASE("Button save states") {
+    std::vector<u8> program = program_with({
+        { 0x00, { JMP, 0x00, 0x50 } },
+        { BUTTON_VECTOR, {
+            IN,  0x00, 0x05,
+            ST,  0x00,
+            INC, 0x0D,
+            RETI,
+        } },
+        { 0x50, {
+            LDI, 0x0C, 0x40,
+            SEI,
+            SLEEP,
+            JMP, 0x00, 0x54,
+        } },
+    });
+
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(program);
+    Buttons buttons { *mcu, 0x05 };
+    SaveState state;
+    buttons.add_to(state);
+
+    buttons.queue({
+        { 100, 0, true },
+        { 500, 2, true },
+        { 900, 0, false },
+    });
+
+    /* One applied, two still queued */
+    mcu->run(300);
+    REQUIRE(buttons.state() == 0x01);
+
+    std::stringstream stream;
+    state.save(stream, *mcu);
+
+    auto loaded = std::make_unique<Mcu>();
+    loaded->load_program(program);
+    Buttons loaded_buttons { *loaded, 0x05 };
+    SaveState loaded_state;
+    loaded_buttons.add_to(loaded_state);
+
+    /* Replaced by what was saved */
+    loaded_buttons.queue({ 200, 5, true });
+    loaded_state.load(stream, *loaded);
+    REQUIRE(loaded_buttons.state() == 0x01);
+    REQUIRE(loaded_buttons.queued() == 2);
+
+    mcu->run(1000);
+    loaded->run(1000);
+    REQUIRE(buttons.state() == 0x04);
+    REQUIRE(loaded_buttons.state() == buttons.state());
+    REQUIRE(loaded_buttons.queued() == 0);
+    REQUIRE(loaded->registers == mcu->registers);
+    REQUIRE(loaded->memory == mcu->memory);
+
+    /* A button that does not exist */
+    SaveState bad;
+    bad.add_device({ 'B', 'T', 'N', 'S' }, [](StateWriter& writer) {
+        writer.write_u8(0x00);
+        writer.write_u32(1);
+        writer.write_u64(10);
+        writer.write_u8(Buttons::count);
+        writer.write_u8(1);
+    }, [](StateReader&) { });
+
+    std::stringstream bad_stream;
+    bad.save(bad_stream, *loaded);
+    REQUIRE_THROWS_AS(loaded_state.load(bad_stream, *loaded), save_state_error);
+    REQUIRE(loaded_buttons.state() == 0x04);
+}
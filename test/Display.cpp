@@ -0,0 +1,129 @@
+#include "catch.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <Display.hpp>
+#include <Mcu.hpp>
+#include <SaveState.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+#include "programs.hpp"
+
+TEST_CASE("Display") {
+    /* Each vblank draws one pixel at the start of the next row */
+    std::vector<u8> program = program_with({
+        { 0x00, { JMP, 0x00, 0x50 } },
+        { VBLANK_VECTOR, {
+            INC, 0x00,
+            ST,  0x00,
+            ADD, 0xD1,
+            RETI,
+        } },
+        { 0x50, {
+            LDI, 0x0C, 0x80,
+            LDI, 0x0D, 0x00,
+            LDI, 0x01, 0x10,
+            SEI,
+            SLEEP,
+            JMP, 0x00, 0x5A,
+        } },
+    });
+
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(program);
+
+    REQUIRE_THROWS_AS(Display(*mcu, 0xFF00, 16, 32, 1000), std::invalid_argument);
+
+    Display display { *mcu, 0x8000, 16, 8, 1000 };
+
+    /* The first frame is all new */
+    for (u16 y = 0; y < 8; y++) {
+        REQUIRE(display.is_dirty(y));
+    }
+    display.clear_dirty();
+    REQUIRE(display.dirty_rows() == Display::Bitmap { 0 });
+
+    mcu->run(1500);
+    REQUIRE(display.frames == 1);
+    REQUIRE(display.dirty_rows() == Display::Bitmap { 0 });
+    REQUIRE(mcu->memory[0x8000] == 1);
+    REQUIRE(display.row(0)[0] == 0);
+
+    mcu->run(1000);
+    REQUIRE(display.frames == 2);
+    REQUIRE(display.dirty_rows() == Display::Bitmap { 0b1 });
+    REQUIRE(display.row(0)[0] == 1);
+
+    /* Rows stay dirty until cleared */
+    display.clear_dirty();
+    mcu->run(3000);
+    REQUIRE(display.frames == 5);
+    REQUIRE(display.dirty_rows() == Display::Bitmap { 0b1110 });
+    REQUIRE(display.row(3)[0] == 4);
+    REQUIRE(display.row(4)[0] == 0);
+    REQUIRE(mcu->sleeping);
+}
+
+TEST_CASE("Display save states") {
+    /* Each vblank stamps the frame count into the next pixel */
+    std::vector<u8> program = program_with({
+        { 0x00, { JMP, 0x00, 0x50 } },
+        { VBLANK_VECTOR, {
+            INC, 0x00,
+            ST,  0x00,
+            INC, 0x0D,
+            RETI,
+        } },
+        { 0x50, {
+            LDI, 0x0C, 0x80,
+            SEI,
+            SLEEP,
+            JMP, 0x00, 0x54,
+        } },
+    });
+
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(program);
+    Display display { *mcu, 0x8000, 4, 4, 300 };
+    SaveState state;
+    display.add_to(state);
+
+    /* Between frames, with rows left dirty */
+    mcu->run(1050);
+    REQUIRE(display.frames == 3);
+
+    std::stringstream stream;
+    state.save(stream, *mcu);
+
+    auto loaded = std::make_unique<Mcu>();
+    loaded->load_program(program);
+    Display loaded_display { *loaded, 0x8000, 4, 4, 300 };
+    SaveState loaded_state;
+    loaded_display.add_to(loaded_state);
+    loaded_state.load(stream, *loaded);
+
+    REQUIRE(loaded_display.frames == display.frames);
+    REQUIRE(loaded_display.dirty_rows() == display.dirty_rows());
+    REQUIRE(std::equal(loaded_display.frame(), loaded_display.frame() + 16, display.frame()));
+
+    /* The next vblank comes when it would have */
+    mcu->run(1000);
+    loaded->run(1000);
+    REQUIRE(loaded_display.frames == display.frames);
+    REQUIRE(loaded->registers == mcu->registers);
+    REQUIRE(loaded->cycles == mcu->cycles);
+    REQUIRE(std::equal(loaded_display.frame(), loaded_display.frame() + 16, display.frame()));
+
+    /* A state of another display */
+    auto other = std::make_unique<Mcu>();
+    Display small { *other, 0x8000, 2, 2, 300 };
+    SaveState small_state;
+    small.add_to(small_state);
+
+    std::stringstream again;
+    state.save(again, *mcu);
+    REQUIRE_THROWS_AS(small_state.load(again, *other), save_state_error);
+    REQUIRE(small.frames == 0);
+}
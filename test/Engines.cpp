@@ -0,0 +1,528 @@
+#include "catch.hpp"
+
+#include <atomic>
+#include <random>
+#include <thread>
+
+#include <Mcu.hpp>
+#include <McuImpl.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+#include "programs.hpp"
+
+namespace {
+    /* Random but well-formed program: every jump lands on an instruction
+     * boundary, except that RET may return to whatever address the stack
+     * happens to hold. The odd illegal byte, some numbered like the
+     * decoder's synthetic handlers, stops the run. The interrupt vectors
+     * hold small handlers ending in RETI, the random body starts at 0x80. */
+    std::vector<u8> random_program(std::mt19937& rng, u16 instructions) {
+        static const u8 opcodes[] = {
+            NOP, SLEEP, BREAK, SEI, SEC, SEZ, CLI, CLC, CLZ,
+            ADD, ADC, SUB, SBC, INC, DEC, AND, OR, XOR, CP, CPI,
+            JMP, CALL, RET, RETI, BRC, BRNC, BRZ, BRNZ,
+            MOV, LDI, LD, ST, PUSH, POP, LPM, IN, OUT,
+        };
+        static const u8 illegal[] = { 0x01, 0x3F, 0x40, 0x41, 0x43, 0x45, 0x80, 0xFF };
+
+        auto random = [&](u32 max) {
+            return std::uniform_int_distribution<u32> { 0, max }(rng);
+        };
+
+        std::vector<u8> program(0x80, NOP);
+        program[0x00] = JMP;
+        program[0x01] = 0x00;
+        program[0x02] = 0x80;
+
+        for (u16 vector : { 0x10, 0x20, 0x40 }) {
+            program[vector + 0] = INC;
+            program[vector + 1] = static_cast<u8>(random(0x0F));
+            program[vector + 2] = IN;
+            program[vector + 3] = static_cast<u8>(random(0x0F));
+            program[vector + 4] = static_cast<u8>(random(3));
+            program[vector + 5] = RETI;
+        }
+
+        std::vector<u16> starts;
+        std::vector<std::pair<size_t, u16>> fixups;
+        u8 follow = 0;
+
+        for (u16 i = 0; i < instructions; i++) {
+            starts.push_back(static_cast<u16>(program.size()));
+
+            u8 opcode = follow ? follow : opcodes[random(sizeof(opcodes) - 1)];
+            follow = 0;
+
+            /* Give the fused compare-and-branch pairs some coverage */
+            if ((opcode == CP || opcode == CPI || opcode == DEC) && random(1) == 0) {
+                follow = random(1) ? BRZ : BRNZ;
+            }
+
+            if (random(63) == 0) {
+                opcode = illegal[random(sizeof(illegal) - 1)];
+            }
+
+            /* Keep sleeps and stack juggling rare enough to get somewhere */
+            if ((opcode == SLEEP || opcode == RET || opcode == RETI || opcode == CLI) && random(7) != 0) {
+                opcode = LDI;
+            }
+
+            program.push_back(opcode);
+
+            switch (opcode) {
+                case ADD: case ADC: case SUB: case SBC: case AND:
+                case OR: case XOR: case CP: case MOV: {
+                    program.push_back(static_cast<u8>(random(0xFF)));
+                    break;
+                }
+                case INC: case DEC: case LD: case ST:
+                case PUSH: case POP: case LPM: {
+                    program.push_back(static_cast<u8>(random(0x0F)));
+                    break;
+                }
+                case CPI: case LDI: case IN: case OUT: {
+                    program.push_back(static_cast<u8>(random(0x0F)));
+                    program.push_back(static_cast<u8>(random(opcode == IN || opcode == OUT ? 3 : 0xFF)));
+                    break;
+                }
+                case JMP: case CALL: case BRC: case BRNC: case BRZ: case BRNZ: {
+                    fixups.emplace_back(program.size(), static_cast<u16>(random(instructions - 1)));
+                    program.push_back(0x00);
+                    program.push_back(0x00);
+                    break;
+                }
+                default: {
+                    break;
+                }
+            }
+        }
+
+        for (auto [ offset, index ] : fixups) {
+            program[offset + 0] = static_cast<u8>(starts[index] >> 8u);
+            program[offset + 1] = static_cast<u8>(starts[index] & 0xFFu);
+        }
+
+        return program;
+    }
+
+    void install_io(Mcu& mcu) {
+        /* Port 0 counts reads, port 1 raises interrupts, port 2 is a latch */
+        auto counter = std::make_shared<u8>(0);
+        auto latch = std::make_shared<u8>(0);
+
+        mcu.io_handlers[0x00] = IoHandler {
+            .get = [counter]() { return (*counter)++; },
+        };
+        mcu.io_handlers[0x01] = IoHandler {
+            .get = []() { return 0x5A; },
+            .set = [&mcu](u8 value) {
+                mcu.raise_interrupts(value & 0x07u);
+            },
+        };
+        mcu.io_handlers[0x02] = IoHandler {
+            .get = [latch]() { return *latch; },
+            .set = [latch](u8 value) { *latch = value; },
+        };
+    }
+
+    void require_same_state(const McuBase& a, const McuBase& b) {
+        REQUIRE(a.pc == b.pc);
+        REQUIRE(a.sp == b.sp);
+        REQUIRE(a.registers == b.registers);
+        REQUIRE(a.flags.carry == b.flags.carry);
+        REQUIRE(a.flags.zero == b.flags.zero);
+        REQUIRE(a.flags.interrupt == b.flags.interrupt);
+        REQUIRE(a.interrupts.mask == b.interrupts.mask);
+        REQUIRE(a.sleeping == b.sleeping);
+        REQUIRE(a.memory == b.memory);
+        REQUIRE(a.memory.dirty_pages() == b.memory.dirty_pages());
+    }
+
+    /* Same ports as install_io minus the interrupt port, resolved statically */
+    struct StaticBus {
+        u8 counter = 0x00;
+        u8 latch = 0x00;
+
+        void io_read(u8 port, u8& value) {
+            if (port == 0x00) {
+                value = this->counter++;
+            }
+            else if (port == 0x02) {
+                value = this->latch;
+            }
+        }
+
+        void io_write(u8 port, u8 value) {
+            if (port == 0x02) {
+                this->latch = value;
+            }
+        }
+
+        u64 io_peek(u8 port, u8& value) {
+            if (port == 0x00) {
+                return 0;
+            }
+            this->io_read(port, value);
+            return UINT64_MAX;
+        }
+
+        void io_skip(u8, u8, u64) { }
+    };
+
+    /* Run the same program on the reference interpreter and on `engine` with
+     * random budgets, raising interrupts between runs. */
+    void compare_engines(Mcu::Engine engine, u32 seed) {
+        std::mt19937 rng { seed };
+
+        auto reference = std::make_unique<Mcu>();
+        auto subject = std::make_unique<Mcu>();
+        subject->engine = engine;
+
+        auto program = random_program(rng, 200);
+        reference->load_program(program);
+        subject->load_program(program);
+        install_io(*reference);
+        install_io(*subject);
+
+        for (int batch = 0; batch < 200; batch++) {
+            u64 budget = std::uniform_int_distribution<u64> { 0, 300 }(rng);
+
+            auto expected = reference->run(budget);
+            auto actual = subject->run(budget);
+
+            REQUIRE(expected.reason == actual.reason);
+            REQUIRE(expected.instructions == actual.instructions);
+            REQUIRE(expected.cycles == actual.cycles);
+            REQUIRE(reference->cycles == subject->cycles);
+            REQUIRE(reference->instructions == subject->instructions);
+            require_same_state(*reference, *subject);
+
+            if (expected.reason == Mcu::StopReason::IllegalOpcode) {
+                break;
+            }
+
+            u8 raise = static_cast<u8>(rng() & 0x0Fu);
+            for (auto mcu : { reference.get(), subject.get() }) {
+                mcu->flags.interrupt |= (raise & 0x08u) != 0;
+                mcu->raise_interrupts(raise & 0x07u);
+            }
+        }
+    }
+}
+
+TEST_CASE("Threaded engine matches the switch interpreter") {
+    for (u32 seed = 1; seed <= 50; seed++) {
+        compare_engines(Mcu::Engine::Threaded, seed);
+    }
+}
+
+TEST_CASE("JIT engine matches the switch interpreter") {
+    for (u32 seed = 1; seed <= 50; seed++) {
+        compare_engines(Mcu::Engine::Jit, seed);
+    }
+}
+
+TEST_CASE("Restoring a snapshot replays identically") {
+    for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        for (u32 seed = 1; seed <= 10; seed++) {
+            std::mt19937 rng { seed };
+
+            auto mcu = std::make_unique<Mcu>();
+            auto replay = std::make_unique<Mcu>();
+            mcu->engine = engine;
+            mcu->load_program(random_program(rng, 200));
+            mcu->sp = 0x80FF;
+
+            /* Ports without host state, so that replays read the same values */
+            for (u8 port = 0; port < 4; port++) {
+                mcu->io_handlers[port].get = [port]() { return static_cast<u8>(0x30 + port); };
+            }
+
+            mcu->run(500);
+            auto snapshot = mcu->snapshot();
+
+            mcu->run(1000);
+            auto expected = mcu->snapshot();
+            replay->load_image(mcu->image);
+            replay->restore(expected);
+            require_same_state(*mcu, *replay);
+
+            mcu->restore(snapshot);
+            REQUIRE(mcu->cycles == snapshot.cycles);
+
+            mcu->run(1000);
+            mcu->snapshot();
+            require_same_state(*mcu, *replay);
+            REQUIRE(mcu->cycles == replay->cycles);
+        }
+    }
+}
+
+TEST_CASE("Static bus matches registered handlers") {
+    for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        for (u32 seed = 1; seed <= 10; seed++) {
+            std::mt19937 rng { seed };
+
+            auto reference = std::make_unique<Mcu>();
+            auto subject = std::make_unique<BasicMcu<StaticBus>>();
+            subject->engine = engine;
+
+            auto program = random_program(rng, 200);
+            reference->load_program(program);
+            subject->load_program(program);
+
+            auto counter = std::make_shared<u8>(0);
+            auto latch = std::make_shared<u8>(0);
+            reference->io_handlers[0x00] = IoHandler {
+                .get = [counter]() { return (*counter)++; },
+            };
+            reference->io_handlers[0x02] = IoHandler {
+                .get = [latch]() { return *latch; },
+                .set = [latch](u8 value) { *latch = value; },
+                .pure = true,
+            };
+
+            for (int batch = 0; batch < 100; batch++) {
+                u64 budget = std::uniform_int_distribution<u64> { 0, 300 }(rng);
+
+                auto expected = reference->run(budget);
+                auto actual = subject->run(budget);
+
+                REQUIRE(expected.reason == actual.reason);
+                REQUIRE(expected.instructions == actual.instructions);
+                require_same_state(*reference, *subject);
+                REQUIRE(subject->latch == *latch);
+
+                u8 raise = static_cast<u8>(rng() & 0x0Fu);
+                for (McuBase* mcu : { static_cast<McuBase*>(reference.get()), static_cast<McuBase*>(subject.get()) }) {
+                    mcu->flags.interrupt |= (raise & 0x08u) != 0;
+                    mcu->raise_interrupts(raise & 0x03u);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("Fused pairs can be interrupted between their halves") {
+    const std::vector<u8> program {
+        JMP, 0x00, 0x20,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        /* vblank: leaves the flags alone */
+        LDI, 0x03, 0x01,
+        RETI,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        /* start: */
+        SEI,
+        LDI, 0x00, 0x06,
+        LDI, 0x01, 0x03,
+        /* loop: */
+        INC, 0x02,
+        CP, 0x01,
+        BRZ, 0x00, 0x2E,
+        CPI, 0x02, 0x02,
+        BRNZ, 0x00, 0x34,
+        DEC, 0x00,
+        BRNZ, 0x00, 0x27,
+        BREAK,
+    };
+
+    for (auto engine : { Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        for (u64 period : { 1, 2, 3, 5 }) {
+            auto reference = std::make_unique<Mcu>();
+            auto subject = std::make_unique<Mcu>();
+            subject->engine = engine;
+            reference->load_program(program);
+            subject->load_program(program);
+
+            REQUIRE(subject->decoded[0x29].handler == CP_BRZ);
+            REQUIRE(subject->decoded[0x2E].handler == CPI_BRNZ);
+            REQUIRE(subject->decoded[0x34].handler == DEC_BRNZ);
+
+            for (int i = 0; i < 200; i++) {
+                auto expected = reference->run(period);
+                auto actual = subject->run(period);
+
+                REQUIRE(expected.reason == actual.reason);
+                REQUIRE(expected.instructions == actual.instructions);
+                require_same_state(*reference, *subject);
+
+                if (expected.reason == Mcu::StopReason::Break) {
+                    break;
+                }
+
+                reference->interrupts.mask = subject->interrupts.mask = i % 3 == 0 ? 1u << VBLANK_INTERRUPT : 0;
+            }
+
+            REQUIRE(subject->registers[0] == 0x00);
+            REQUIRE(subject->registers[3] == 0x01);
+        }
+    }
+}
+
+TEST_CASE("Bytes numbered like synthetic handlers are illegal") {
+    for (u8 opcode : { IDLE_LOOP, CP_BRZ, CP_BRNZ, CPI_BRZ, CPI_BRNZ, DEC_BRNZ }) {
+        for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+            auto mcu = std::make_unique<Mcu>();
+            mcu->engine = engine;
+            mcu->illegal_opcode_mode = Mcu::IllegalOpcodeMode::Trap;
+            mcu->load_program({ NOP, opcode, NOP, NOP, BREAK });
+
+            auto result = mcu->run(1000);
+
+            REQUIRE(result.reason == Mcu::StopReason::IllegalOpcode);
+            REQUIRE(result.instructions == 2);
+            REQUIRE(mcu->trap.opcode == opcode);
+            REQUIRE(mcu->trap.pc == 1);
+        }
+    }
+}
+
+TEST_CASE("Every illegal opcode traps on every engine") {
+    for (u32 opcode = 0x00; opcode <= 0xFF; opcode++) {
+        const std::vector<u8> program { NOP, static_cast<u8>(opcode), NOP, NOP, BREAK };
+
+        std::array<u8, 0x10000> image {};
+        std::copy(program.begin(), program.end(), image.begin());
+        const bool illegal = decode(image, 1).handler == ILLEGAL;
+
+        for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+            auto mcu = std::make_unique<Mcu>();
+            mcu->engine = engine;
+            mcu->illegal_opcode_mode = Mcu::IllegalOpcodeMode::Trap;
+            mcu->load_program(program);
+
+            auto result = mcu->run(1000);
+
+            INFO("opcode " << opcode);
+            REQUIRE(mcu->trap.raised == illegal);
+            if (illegal) {
+                REQUIRE(result.reason == Mcu::StopReason::IllegalOpcode);
+                REQUIRE(mcu->pc == 2);
+                REQUIRE(mcu->trap.opcode == opcode);
+                REQUIRE(mcu->trap.pc == 1);
+            }
+        }
+    }
+}
+
+TEST_CASE("Idle loops are skipped") {
+    const std::vector<u8> spin {
+        LDI, 0x00, 0x05,
+        JMP, 0x00, 0x03,
+    };
+
+    /* Enters the loop halfway with a stale R0, polls a port until it reads 0x80 */
+    const std::vector<u8> poll {
+        LDI, 0x00, 0x42,
+        JMP, 0x00, 0x09,
+        IN,  0x00, 0x01,
+        CPI, 0x00, 0x80,
+        BRNZ, 0x00, 0x06,
+        INC, 0x01,
+        BREAK,
+    };
+
+    for (auto engine : { Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        for (const auto& program : { spin, poll }) {
+            auto reference = std::make_unique<Mcu>();
+            auto subject = std::make_unique<Mcu>();
+            subject->engine = engine;
+
+            u8 port = 0x00;
+            for (auto mcu : { reference.get(), subject.get() }) {
+                mcu->load_program(program);
+                mcu->io_handlers[0x01] = IoHandler {
+                    .get = [&port]() { return port; },
+                    .pure = true,
+                };
+            }
+
+            for (u64 budget : { 1, 2, 3, 7, 100, 1001 }) {
+                auto expected = reference->run(budget);
+                auto actual = subject->run(budget);
+
+                REQUIRE(expected.reason == actual.reason);
+                REQUIRE(expected.instructions == actual.instructions);
+                REQUIRE(expected.cycles == actual.cycles);
+                require_same_state(*reference, *subject);
+            }
+
+            /* Would take hours without skipping */
+            auto result = subject->run(1'000'000'000'000);
+            REQUIRE(result.reason == Mcu::StopReason::Budget);
+            REQUIRE(result.cycles == 1'000'000'000'000);
+
+            port = 0x80;
+            result = subject->run(1'000'000'000'000);
+            REQUIRE(subject->registers[1] == (program == poll ? 1 : 0));
+            REQUIRE(result.reason == (program == poll ? Mcu::StopReason::Break : Mcu::StopReason::Budget));
+        }
+    }
+}
+
+TEST_CASE("Loops polling impure ports are not skipped") {
+    auto mcu = std::make_unique<Mcu>();
+    mcu->engine = Mcu::Engine::Threaded;
+
+    mcu->load_program({
+        IN,  0x00, 0x01,
+        CPI, 0x00, 0x80,
+        BRNZ, 0x00, 0x00,
+    });
+
+    u64 reads = 0;
+    mcu->io_handlers[0x01] = IoHandler {
+        .get = [&reads]() { reads++; return 0x00; },
+    };
+
+    /* Four cycles per iteration with the branch taken */
+    mcu->run(4000);
+
+    REQUIRE(reads == 1000);
+}
+
+TEST_CASE("Interrupts can be requested from another thread") {
+    std::vector<u8> program = program_with({
+        { 0x00, { JMP, 0x00, 0x50 } },
+        { BUTTON_VECTOR, { OUT, 0x00, 0x01, RETI } },
+        { 0x50, {
+            SEI,
+            INC, 0x01,
+            JMP, 0x00, 0x51,
+        } },
+    });
+
+    for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        auto mcu = std::make_unique<Mcu>();
+        mcu->engine = engine;
+        mcu->load_program(program);
+
+        std::atomic<u32> handled { 0 };
+        mcu->io_handlers[0x01].set = [&handled](u8) { handled++; };
+
+        /* One request at a time, each waiting for the handler, so none of
+         * them merge */
+        std::atomic<bool> done { false };
+        std::thread host { [&]() {
+            for (u32 i = 0; i < 100; i++) {
+                mcu->request_interrupts(1u << BUTTON_INTERRUPT);
+                while (handled.load() <= i) {
+                    std::this_thread::yield();
+                }
+            }
+            done = true;
+        } };
+
+        while (!done.load()) {
+            mcu->run(1000);
+        }
+        host.join();
+
+        /* The main loop ran in between, beyond SEI, the JMP to it and two
+         * instructions per handler. Its counter is a byte and may wrap, so
+         * count instructions instead. */
+        REQUIRE(handled.load() == 100);
+        REQUIRE(mcu->instructions > 2 + 100 * 2);
+    }
+}
@@ -0,0 +1,211 @@
+#include "catch.hpp"
+
+#include <thread>
+
+#include <Instruction.hpp>
+#include <Mcu.hpp>
+#include <opcodes.hpp>
+
+TEST_CASE("Instruction decoding") {
+    std::array<u8, 0x10000> program {};
+
+    SECTION("register pair") {
+        program[0] = ADD;
+        program[1] = 0x3A;
+
+        auto insn = decode(program, 0);
+
+        REQUIRE(insn.opcode == ADD);
+        REQUIRE(insn.length == 2);
+        REQUIRE(insn.a == 0x3);
+        REQUIRE(insn.b == 0xA);
+    }
+
+    SECTION("register and immediate") {
+        program[0] = CPI;
+        program[1] = 0x05;
+        program[2] = 0xEE;
+
+        auto insn = decode(program, 0);
+
+        REQUIRE(insn.opcode == CPI);
+        REQUIRE(insn.length == 3);
+        REQUIRE(insn.a == 0x5);
+        REQUIRE(insn.b == 0xEE);
+    }
+
+    SECTION("address") {
+        program[0] = BRNZ;
+        program[1] = 0x12;
+        program[2] = 0x34;
+
+        auto insn = decode(program, 0);
+
+        REQUIRE(insn.opcode == BRNZ);
+        REQUIRE(insn.length == 3);
+        REQUIRE(insn.target == 0x1234);
+    }
+
+    SECTION("operands wrap around the address space") {
+        program[0xFFFF] = JMP;
+        program[0x0000] = 0xAB;
+        program[0x0001] = 0xCD;
+
+        auto insn = decode(program, 0xFFFF);
+
+        REQUIRE(insn.target == 0xABCD);
+    }
+
+    SECTION("idle loops") {
+        /* spin: jmp spin */
+        program[0x00] = JMP;
+        program[0x01] = 0x00;
+        program[0x02] = 0x00;
+
+        /* poll: in R0, 0x01; cpi R0, 0x80; brnz poll */
+        program[0x10] = IN;
+        program[0x11] = 0x00;
+        program[0x12] = 0x01;
+        program[0x13] = CPI;
+        program[0x14] = 0x00;
+        program[0x15] = 0x80;
+        program[0x16] = BRNZ;
+        program[0x17] = 0x00;
+        program[0x18] = 0x10;
+
+        /* recurse: call recurse */
+        program[0x20] = CALL;
+        program[0x21] = 0x00;
+        program[0x22] = 0x20;
+
+        REQUIRE(decode(program, 0x00).handler == IDLE_LOOP);
+        REQUIRE(decode(program, 0x16).handler == IDLE_LOOP);
+        REQUIRE(decode(program, 0x16).opcode == BRNZ);
+        REQUIRE(decode(program, 0x10).handler == IN);
+        REQUIRE(decode(program, 0x13).handler == CPI);
+        REQUIRE(decode(program, 0x20).handler == CALL);
+    }
+
+    SECTION("fused pairs") {
+        /* cp R1, R2; brz 0x1234 */
+        program[0x00] = CP;
+        program[0x01] = 0x12;
+        program[0x02] = BRZ;
+        program[0x03] = 0x12;
+        program[0x04] = 0x34;
+
+        /* dec R3; brnz 0x0005 */
+        program[0x05] = DEC;
+        program[0x06] = 0x03;
+        program[0x07] = BRNZ;
+        program[0x08] = 0x00;
+        program[0x09] = 0x05;
+
+        /* dec R3; brz 0x0000 is not fused */
+        program[0x0A] = DEC;
+        program[0x0B] = 0x03;
+        program[0x0C] = BRZ;
+
+        auto cp = decode(program, 0x00);
+        REQUIRE(cp.opcode == CP);
+        REQUIRE(cp.handler == CP_BRZ);
+        REQUIRE(cp.length == 2);
+        REQUIRE(cp.a == 0x01);
+        REQUIRE(cp.b == 0x02);
+        REQUIRE(cp.target == 0x1234);
+
+        auto dec = decode(program, 0x05);
+        REQUIRE(dec.handler == DEC_BRNZ);
+        REQUIRE(dec.a == 0x03);
+        REQUIRE(dec.target == 0x0005);
+
+        REQUIRE(decode(program, 0x02).handler == BRZ);
+        REQUIRE(decode(program, 0x0A).handler == DEC);
+    }
+
+    SECTION("illegal opcode") {
+        program[0] = 0xFF;
+
+        auto insn = decode(program, 0);
+
+        REQUIRE(insn.opcode == 0xFF);
+        REQUIRE(insn.handler == ILLEGAL);
+        REQUIRE(insn.length == 1);
+
+        /* Not to be taken for the synthetic handlers sharing its number */
+        program[0] = IDLE_LOOP;
+        REQUIRE(decode(program, 0).handler == ILLEGAL);
+    }
+}
+
+TEST_CASE("Decode cache follows load_program") {
+    Mcu mcu;
+
+    mcu.load_program({
+        LDI, 0x00, 0x05,
+        DEC, 0x00,
+        BRNZ, 0x00, 0x03,
+    });
+
+    REQUIRE(mcu.decoded[0].opcode == LDI);
+    REQUIRE(mcu.decoded[3].opcode == DEC);
+    REQUIRE(mcu.decoded[5].target == 0x0003);
+
+    mcu.steps(11);
+
+    REQUIRE(mcu.registers[0] == 0x00);
+    REQUIRE(mcu.flags.zero);
+    REQUIRE(mcu.pc == 8);
+
+    mcu.load_program({ 0xFF });
+    mcu.reset();
+
+    REQUIRE_THROWS_AS(mcu.step(), illegal_opcode_error);
+    REQUIRE(mcu.pc == 1);
+}
+
+TEST_CASE("Instances share a program image") {
+    auto image = ProgramImage::create({
+        LDI, 0x00, 0x05,
+        DEC, 0x00,
+        BRNZ, 0x00, 0x03,
+        LPM, 0x01,
+        BREAK,
+    });
+
+    auto a = std::make_unique<Mcu>();
+    auto b = std::make_unique<Mcu>();
+    a->load_image(image);
+    b->load_image(image);
+
+    REQUIRE(a->program == image->bytes().data());
+    REQUIRE(a->decoded == b->decoded);
+    REQUIRE(a->decoded[3].opcode == DEC);
+
+    for (auto mcu : { a.get(), b.get() }) {
+        mcu->engine = Mcu::Engine::Jit;
+        auto result = mcu->run(1000);
+
+        REQUIRE(result.reason == Mcu::StopReason::Break);
+        REQUIRE(mcu->registers[0] == 0x00);
+        REQUIRE(mcu->registers[1] == LDI);
+    }
+
+    REQUIRE(a->jit == b->jit);
+
+    /* Other threads translate on their own, the image lets go of their
+     * translations when they exit */
+    std::shared_ptr<Jit> other;
+    std::thread { [&other, &image, &b]() { other = image->translations(*b); } }.join();
+    REQUIRE(other != a->jit);
+    REQUIRE(other.use_count() == 1);
+
+    std::weak_ptr<Jit> gone;
+    std::thread { [&gone, &image, &b]() { gone = image->translations(*b); } }.join();
+    REQUIRE(gone.expired());
+
+    a->load_program({ NOP });
+    REQUIRE(a->image != image);
+    REQUIRE(a->jit == nullptr);
+    REQUIRE(b->image == image);
+}
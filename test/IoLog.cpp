@@ -0,0 +1,275 @@
+#include "catch.hpp"
+
+#include <sstream>
+
+#include <IoLog.hpp>
+#include <Mcu.hpp>
+#include <Serial.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+#include "programs.hpp"
+
+namespace {
+    std::vector<u8> echo_program() {
+        return program_with({
+            { 0x00, { JMP, 0x00, 0x50 } },
+            { VBLANK_VECTOR, { INC, 0x05, RETI } },
+            { BUTTON_VECTOR, { INC, 0x06, RETI } },
+            { 0x50, {
+                LDI, 0x0C, 0x40,
+                LDI, 0x0D, 0x00,
+                SEI,
+                IN,  0x00, 0x01,
+                ST,  0x00,
+                INC, 0x0D,
+                OUT, 0x00, 0x02,
+                ADD, 0x10,
+                JMP, 0x00, 0x57,
+            } },
+        });
+    }
+
+    /* Waits for port 0x01 to read nonzero, counts it in r5, then waits for
+     * it to read zero again */
+    std::vector<u8> poll_program() {
+        return program_with({
+            { 0x00, {
+                IN,   0x00, 0x01,
+                CPI,  0x00, 0x00,
+                BRZ,  0x00, 0x00,
+                INC,  0x05,
+                IN,   0x00, 0x01,
+                CPI,  0x00, 0x00,
+                BRNZ, 0x00, 0x0B,
+                JMP,  0x00, 0x00,
+            } },
+        });
+    }
+
+    /* Sends a byte with the transmitter interrupt enabled, counting
+     * interrupts in r5 */
+    std::vector<u8> transmit_program() {
+        return program_with({
+            { 0x00, { JMP, 0x00, 0x50 } },
+            { SERIAL_VECTOR, { INC, 0x05, RETI } },
+            { 0x50, {
+                LDI, 0x01, SERIAL_TX_INTERRUPT,
+                OUT, 0x01, 0x11,
+                SEI,
+                LDI, 0x02, 0x41,
+                OUT, 0x02, 0x10,
+                INC, 0x00,
+                JMP, 0x00, 0x5C,
+            } },
+        });
+    }
+}
+
+TEST_CASE("I/O logs replay a session without the handlers") {
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(echo_program());
+
+    u32 reads = 0;
+    u32 raises = 0;
+    mcu->io_handlers[0x01].get = [&reads]() { return static_cast<u8>(++reads * 7); };
+    mcu->io_handlers[0x02].set = [&mcu, &raises](u8 value) {
+        if (value % 5 == 0) {
+            mcu->raise_interrupts(1u << BUTTON_INTERRUPT);
+            raises++;
+        }
+    };
+
+    std::stringstream log;
+    {
+        IoRecorder recorder { *mcu, log };
+        for (int i = 0; i < 40; i++) {
+            if (i % 3 == 0) {
+                mcu->raise_interrupts(1u << VBLANK_INTERRUPT);
+                raises++;
+            }
+            recorder.run(37);
+        }
+    }
+
+    REQUIRE(mcu->registers[5] > 0);
+    REQUIRE(mcu->registers[6] > 0);
+
+    /* Header, a few bytes per run, then mostly a byte per IN and two per
+     * interrupt */
+    REQUIRE(log.str().size() <= 22 + 40 * 7 + reads + raises * 2);
+
+    auto replay = std::make_unique<Mcu>();
+    replay->load_program(echo_program());
+
+    u32 calls = 0;
+    replay->io_handlers[0x01].get = [&calls]() { calls++; return 0x00; };
+    replay->io_handlers[0x02].set = [&calls](u8) { calls++; };
+
+    SECTION("in different slices") {
+        IoPlayer player { *replay, log };
+        while (replay->cycles < mcu->cycles) {
+            player.run(std::min<u64>(101, mcu->cycles - replay->cycles));
+        }
+
+        REQUIRE(calls == 0);
+        REQUIRE(player.finished());
+        REQUIRE(replay->pc == mcu->pc);
+        REQUIRE(replay->sp == mcu->sp);
+        REQUIRE(replay->registers == mcu->registers);
+        REQUIRE(replay->pending_interrupts() == mcu->pending_interrupts());
+        REQUIRE(replay->instructions == mcu->instructions);
+        REQUIRE(replay->memory == mcu->memory);
+    }
+
+    SECTION("diverging") {
+        std::vector<u8> program = echo_program();
+        program[0x56] = NOP;
+
+        replay->load_program(program);
+        IoPlayer player { *replay, log };
+        REQUIRE_THROWS_AS(player.run(mcu->cycles), io_log_error);
+    }
+
+    SECTION("from elsewhere") {
+        replay->cycles = 5;
+        REQUIRE_THROWS_AS(IoPlayer(*replay, log), io_log_error);
+
+        std::stringstream garbage { "MCUS" };
+        replay->cycles = 0;
+        REQUIRE_THROWS_AS(IoPlayer(*replay, garbage), io_log_error);
+    }
+}
+
+TEST_CASE("I/O logs keep skipping poll loops") {
+    for (auto engine : { Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        /* Against the reference interpreter, which never skips */
+        u8 level = 0x00;
+        u32 reads = 0;
+        auto mcu = std::make_unique<Mcu>();
+        auto unrecorded = std::make_unique<Mcu>();
+        mcu->engine = engine;
+        mcu->load_program(poll_program());
+        unrecorded->load_program(poll_program());
+        mcu->io_handlers[0x01] = IoHandler {
+            .get = [&level, &reads]() { reads++; return level; },
+            .pure = true,
+        };
+        unrecorded->io_handlers[0x01] = IoHandler {
+            .get = [&level]() { return level; },
+            .pure = true,
+        };
+
+        std::stringstream log;
+        {
+            IoRecorder recorder { *mcu, log };
+            for (int i = 0; i < 10; i++) {
+                level = static_cast<u8>(i % 2);
+                recorder.run(1'000'000);
+                unrecorded->run(1'000'000);
+            }
+        }
+
+        /* Runs as if unrecorded, reading the port a few times per run
+         * rather than once per iteration, and every poll loop takes a few
+         * bytes */
+        REQUIRE(reads < 100);
+        REQUIRE(mcu->registers[5] == 5);
+        REQUIRE(mcu->cycles == unrecorded->cycles);
+        REQUIRE(mcu->instructions == unrecorded->instructions);
+        REQUIRE(log.str().size() <= 22 + 10 * 20);
+
+        auto replay = std::make_unique<Mcu>();
+        replay->engine = engine;
+        replay->load_program(poll_program());
+
+        IoPlayer player { *replay, log };
+        while (replay->cycles < mcu->cycles) {
+            player.run(std::min<u64>(99'991, mcu->cycles - replay->cycles));
+        }
+
+        REQUIRE(player.finished());
+        REQUIRE(replay->pc == mcu->pc);
+        REQUIRE(replay->registers == mcu->registers);
+        REQUIRE(replay->instructions == mcu->instructions);
+    }
+}
+
+TEST_CASE("I/O logs let replays skip what recording could not") {
+    /* Impure, so polled read by read, but replaying knows what comes */
+    u32 reads = 0;
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(poll_program());
+    mcu->io_handlers[0x01].get = [&reads]() { return static_cast<u8>(++reads % 1000 == 0); };
+
+    std::stringstream log;
+    {
+        IoRecorder recorder { *mcu, log };
+        recorder.run(100'000);
+    }
+    REQUIRE(mcu->registers[5] > 0);
+
+    for (auto engine : { Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        auto replay = std::make_unique<Mcu>();
+        replay->engine = engine;
+        replay->load_program(poll_program());
+
+        log.clear();
+        log.seekg(0);
+        IoPlayer player { *replay, log };
+        player.run(mcu->cycles);
+
+        REQUIRE(player.finished());
+        REQUIRE(replay->pc == mcu->pc);
+        REQUIRE(replay->registers == mcu->registers);
+        REQUIRE(replay->instructions == mcu->instructions);
+    }
+}
+
+TEST_CASE("I/O logs are checked at the end of every run") {
+    /* Nothing but instruction counts to tell the two apart */
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(program_with({ { 0x00, { INC, 0x00, JMP, 0x00, 0x00 } } }));
+
+    std::stringstream log;
+    {
+        IoRecorder recorder { *mcu, log };
+        recorder.run(100);
+    }
+
+    auto replay = std::make_unique<Mcu>();
+    replay->load_program(program_with({ { 0x00, { INC, 0x00, NOP, JMP, 0x00, 0x00 } } }));
+
+    IoPlayer player { *replay, log };
+    REQUIRE_NOTHROW(player.run(50));
+    REQUIRE_THROWS_AS(player.run(50), io_log_error);
+}
+
+TEST_CASE("I/O logs see interrupts from events scheduled in a run") {
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(transmit_program());
+    Serial serial { *mcu, 0x10, 100 };
+
+    /* The byte goes out in the middle of the first run, the transmitter
+     * going idle raises the interrupt from an event scheduled by OUT */
+    std::stringstream log;
+    {
+        IoRecorder recorder { *mcu, log };
+        recorder.run(500);
+        recorder.run(500);
+    }
+
+    /* Enabling the interrupt with nothing to send, then sending */
+    REQUIRE(mcu->registers[5] == 2);
+    REQUIRE(serial.output.size() == 1);
+
+    auto replay = std::make_unique<Mcu>();
+    replay->load_program(transmit_program());
+
+    IoPlayer player { *replay, log };
+    player.run(1000);
+
+    REQUIRE(player.finished());
+    REQUIRE(replay->registers == mcu->registers);
+    REQUIRE(replay->instructions == mcu->instructions);
+}
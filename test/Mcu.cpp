@@ -7,6 +7,9 @@
 #include <iostream>
 
 #include <Mcu.hpp>
+#include <cycles.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
 
 namespace {
     void compile_and_load(Mcu& mcu, const std::string &source) {
@@ -432,9 +435,262 @@ TEST_CASE("Instruction tests") {
         )");
 
         mcu.steps(3);
-        mcu.interrupts.button = true;
+        mcu.raise_interrupts(1u << BUTTON_INTERRUPT);
         mcu.steps(3);
 
         REQUIRE(mcu.registers[0] == 0xAB);
     }
+
+    SECTION("unmapped ports") {
+        u8 written = 0x00;
+        mcu.io_handlers[0x10].set = [&written](u8 value) { written = value; };
+
+        mcu.load_program({
+            LDI, 0x00, 0x42,
+            IN,  0x00, 0x11,
+            OUT, 0x00, 0x10,
+            IN,  0x00, 0x10,
+            OUT, 0x00, 0x12,
+        });
+        mcu.steps(5);
+
+        REQUIRE(mcu.io_handlers.contains(0x10));
+        REQUIRE_FALSE(mcu.io_handlers.contains(0x11));
+        REQUIRE(written == 0x42);
+        REQUIRE(mcu.registers[0] == 0x00);
+
+        mcu.io_handlers.erase(0x10);
+        mcu.reset();
+        mcu.registers[0] = 0x42;
+        mcu.pc = 3;
+        mcu.steps(3);
+
+        REQUIRE(mcu.io_handlers.find(0x10) == nullptr);
+        REQUIRE(mcu.registers[0] == 0x42);
+    }
+}
+
+TEST_CASE("Run loop") {
+    Mcu mcu;
+
+    SECTION("budget") {
+        compile_and_load(mcu, R"(
+            loop:
+              inc R0
+              jmp loop
+        )");
+
+        auto result = mcu.run(1000);
+
+        /* Three cycles per iteration, the last one stops after `inc` */
+        REQUIRE(result.reason == Mcu::StopReason::Budget);
+        REQUIRE(result.instructions == 667);
+        REQUIRE(result.cycles == 1000);
+        REQUIRE(mcu.registers[0] == static_cast<u8>(334));
+    }
+
+    SECTION("break") {
+        compile_and_load(mcu, R"(
+            ldi R0, 0x42
+            break
+            ldi R0, 0x00
+        )");
+
+        auto result = mcu.run(1000);
+
+        REQUIRE(result.reason == Mcu::StopReason::Break);
+        REQUIRE(result.instructions == 2);
+        REQUIRE(mcu.registers[0] == 0x42);
+        REQUIRE(mcu.pc == 4);
+    }
+
+    SECTION("sleep with interrupts disabled") {
+        compile_and_load(mcu, R"(
+            cli
+            sleep
+        )");
+
+        auto result = mcu.run(1000);
+
+        REQUIRE(result.reason == Mcu::StopReason::Sleep);
+        REQUIRE(result.instructions == 2);
+        REQUIRE(mcu.sleeping);
+    }
+
+    SECTION("sleep fast-forward") {
+        compile_and_load(mcu, R"(
+            org 0x00
+              sei
+              sleep
+              jmp 0x00
+
+            org 0x10 ; VBlank
+              inc R0
+              reti
+        )");
+
+        auto result = mcu.run(1'000'000);
+
+        REQUIRE(result.reason == Mcu::StopReason::Budget);
+        REQUIRE(result.instructions == 2);
+        REQUIRE(result.cycles == 1'000'000);
+        REQUIRE(mcu.cycles == 1'000'000);
+        REQUIRE(mcu.sleeping);
+
+        mcu.raise_interrupts(1u << VBLANK_INTERRUPT);
+        result = mcu.run(1'000'000);
+
+        REQUIRE(result.instructions == 5);
+        REQUIRE(mcu.registers[0] == 1);
+        REQUIRE(mcu.sleeping);
+    }
+
+    SECTION("cycles") {
+        compile_and_load(mcu, R"(
+            org 0x00
+              jmp main
+
+            org 0x10 ; VBlank
+              reti
+
+            org 0x20
+            main:
+              ldi R0, 1
+              cpi R0, 1
+              brz taken
+              nop
+            taken:
+              brnz taken
+              call function
+              sei
+              nop
+              break
+
+            function:
+              ret
+        )");
+
+        /* jmp, ldi, cpi, brz taken, brnz not taken, call, ret, sei */
+        for (u64 cycles : { 2, 1, 1, 2, 1, 3, 4, 1 }) {
+            u64 before = mcu.cycles;
+            mcu.step();
+            REQUIRE(mcu.cycles - before == cycles);
+        }
+
+        /* Interrupt entry, then reti */
+        mcu.raise_interrupts(1u << VBLANK_INTERRUPT);
+        mcu.step();
+        REQUIRE(mcu.cycles == 15 + INTERRUPT_CYCLES + 4);
+        REQUIRE(mcu.instructions == 9);
+
+        auto result = mcu.run(100);
+        REQUIRE(result.reason == Mcu::StopReason::Break);
+        REQUIRE(result.cycles == 2);
+    }
+
+    SECTION("interrupt priority") {
+        compile_and_load(mcu, R"(
+            org 0x00
+              sei
+              sleep
+              jmp 0x00
+
+            org 0x10 ; VBlank
+              ldi R0, 1
+              reti
+
+            org 0x20 ; Button
+              ldi R0, 2
+              reti
+
+            org 0x40 ; Serial
+              ldi R0, 3
+              reti
+        )");
+
+        mcu.raise_interrupts(1u << SERIAL_INTERRUPT | 1u << BUTTON_INTERRUPT | 0x80u);
+        REQUIRE(mcu.pending_interrupts() == (1u << BUTTON_INTERRUPT | 1u << SERIAL_INTERRUPT));
+
+        mcu.steps(2);
+        REQUIRE_FALSE(mcu.interrupt_due());
+        REQUIRE(mcu.registers[0] == 2);
+        REQUIRE_FALSE(mcu.interrupts.button());
+        REQUIRE(mcu.interrupts.serial());
+
+        mcu.step();
+        REQUIRE(mcu.interrupt_due());
+
+        mcu.raise_interrupts(1u << VBLANK_INTERRUPT);
+        REQUIRE(mcu.interrupts.vblank());
+
+        mcu.step();
+        REQUIRE(mcu.registers[0] == 1);
+        REQUIRE(mcu.pending_interrupts() == 1u << SERIAL_INTERRUPT);
+    }
+
+    SECTION("illegal opcode") {
+        mcu.load_program({ NOP, 0xFF });
+
+        auto result = mcu.run(1000);
+
+        REQUIRE(result.reason == Mcu::StopReason::IllegalOpcode);
+        REQUIRE(mcu.pc == 2);
+        REQUIRE(mcu.trap.raised);
+        REQUIRE(mcu.trap.opcode == 0xFF);
+        REQUIRE(mcu.trap.pc == 1);
+    }
+
+    SECTION("illegal opcode trap") {
+        mcu.illegal_opcode_mode = Mcu::IllegalOpcodeMode::Trap;
+        mcu.load_program({ NOP, NOP, 0xFE, NOP });
+
+        for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+            mcu.reset();
+            mcu.engine = engine;
+
+            auto result = mcu.run(1000);
+
+            REQUIRE(result.reason == Mcu::StopReason::IllegalOpcode);
+            REQUIRE(result.instructions == 3);
+            REQUIRE(mcu.pc == 3);
+            REQUIRE(mcu.trap.raised);
+            REQUIRE(mcu.trap.opcode == 0xFE);
+            REQUIRE(mcu.trap.pc == 2);
+        }
+
+        mcu.reset();
+        REQUIRE_FALSE(mcu.trap.raised);
+
+        mcu.steps(2);
+        REQUIRE_NOTHROW(mcu.step());
+        REQUIRE(mcu.trap.raised);
+        REQUIRE(mcu.pc == 3);
+    }
+}
+
+TEST_CASE("Copies take requests in flight along") {
+    Mcu mcu;
+    mcu.load_program({ INC, 0x01, JMP, 0x00, 0x00 });
+    mcu.run(100);
+    mcu.request_interrupts(1u << BUTTON_INTERRUPT);
+
+    Mcu copy = mcu;
+    REQUIRE(copy.pc == mcu.pc);
+    REQUIRE(copy.registers == mcu.registers);
+    REQUIRE(copy.cycles == mcu.cycles);
+    REQUIRE(copy.memory == mcu.memory);
+
+    copy.poll_requests();
+    REQUIRE(copy.interrupts.button());
+
+    Mcu assigned;
+    assigned = mcu;
+    REQUIRE(assigned.release_requests() == 1u << BUTTON_INTERRUPT);
+
+    Mcu moved = std::move(assigned);
+    REQUIRE(moved.pc == mcu.pc);
+    REQUIRE(moved.memory == mcu.memory);
+
+    mcu.poll_requests();
+    REQUIRE(mcu.interrupts.button());
 }
@@ -0,0 +1,257 @@
+#include "catch.hpp"
+
+#include <Buttons.hpp>
+#include <Mcu.hpp>
+#include <Memory.hpp>
+#include <Serial.hpp>
+#include <opcodes.hpp>
+
+TEST_CASE("Memory tracks dirty pages") {
+    auto memory = std::make_unique<Memory>();
+
+    REQUIRE(memory->dirty_count() == 0);
+
+    memory->write(0x0000, 0x11);
+    memory->write(0x00FF, 0x22);
+    memory->write(0x4180, 0x33);
+    memory->write(0xFFFF, 0x44);
+
+    REQUIRE(memory->dirty_count() == 3);
+    REQUIRE(memory->is_dirty(0x00));
+    REQUIRE(memory->is_dirty(0x41));
+    REQUIRE(memory->is_dirty(0xFF));
+    REQUIRE_FALSE(memory->is_dirty(0x01));
+    REQUIRE(memory->dirty_pages()[1] == u64 { 1 } << 1u);
+    REQUIRE(memory->read(0x4180) == 0x33);
+
+    auto other = std::make_unique<Memory>();
+    REQUIRE(*memory != *other);
+
+    other->write(0x0000, 0x11);
+    other->write(0x00FF, 0x22);
+    other->write(0x4180, 0x33);
+    other->write(0xFFFF, 0x44);
+    other->write(0x8000, 0x00);
+    REQUIRE(*memory == *other);
+
+    memory->reset();
+
+    REQUIRE(memory->dirty_count() == 0);
+    for (u32 addr = 0; addr < Memory::size; addr++) {
+        REQUIRE((*memory)[static_cast<u16>(addr)] == 0x00);
+    }
+}
+
+TEST_CASE("Engines mark the pages they write") {
+    for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        auto mcu = std::make_unique<Mcu>();
+        mcu->engine = engine;
+
+        mcu->load_program({
+            LDI, 0x0C, 0x12,
+            LDI, 0x0D, 0x34,
+            ST,  0x00,
+            PUSH, 0x00,
+            CALL, 0x00, 0x10,
+            BREAK,
+            0x00, 0x00, 0x00,
+            RET,
+        });
+        mcu->registers[0] = 0xAB;
+        mcu->sp = 0x8000;
+
+        auto result = mcu->run(100);
+
+        REQUIRE(result.reason == Mcu::StopReason::Break);
+        REQUIRE(mcu->memory[0x1234] == 0xAB);
+        REQUIRE(mcu->memory[0x8000] == 0xAB);
+        REQUIRE(mcu->memory.dirty_count() == 3);
+        REQUIRE(mcu->memory.is_dirty(0x12));
+        REQUIRE(mcu->memory.is_dirty(0x80));
+        REQUIRE(mcu->memory.is_dirty(0x7F));
+
+        mcu->reset();
+
+        REQUIRE(mcu->memory.dirty_count() == 0);
+        REQUIRE(mcu->memory[0x1234] == 0x00);
+        REQUIRE(mcu->memory[0x7FFF] == 0x00);
+    }
+}
+
+TEST_CASE("Memory snapshots share unchanged pages") {
+    auto memory = std::make_unique<Memory>();
+
+    memory->write(0x1000, 0x11);
+    memory->write(0x2000, 0x22);
+    auto first = memory->snapshot();
+
+    REQUIRE(memory->dirty_count() == 0);
+    REQUIRE((*first)[0x10] != nullptr);
+    REQUIRE((*first)[0x30] == nullptr);
+
+    memory->write(0x2000, 0x33);
+    memory->write(0x3000, 0x44);
+    auto second = memory->snapshot();
+
+    REQUIRE((*second)[0x10] == (*first)[0x10]);
+    REQUIRE((*second)[0x20] != (*first)[0x20]);
+    REQUIRE(memory->snapshot() == second);
+
+    memory->write(0x4000, 0x55);
+    memory->restore(first);
+
+    REQUIRE(memory->dirty_count() == 0);
+    REQUIRE(memory->read(0x1000) == 0x11);
+    REQUIRE(memory->read(0x2000) == 0x22);
+    REQUIRE(memory->read(0x3000) == 0x00);
+    REQUIRE(memory->read(0x4000) == 0x00);
+
+    auto other = std::make_unique<Memory>();
+    other->write(0x1000, 0x11);
+    other->write(0x2000, 0x22);
+    REQUIRE(*memory == *other);
+
+    memory->restore(second);
+    REQUIRE(memory->read(0x2000) == 0x33);
+    REQUIRE(memory->read(0x3000) == 0x44);
+    REQUIRE(*memory != *other);
+
+    memory->reset();
+    REQUIRE(memory->read(0x1000) == 0x00);
+    REQUIRE(memory->read(0x3000) == 0x00);
+    REQUIRE(*memory == Memory {});
+}
+
+TEST_CASE("Memory copies share clean pages") {
+    auto memory = std::make_unique<Memory>();
+
+    memory->write(0x1000, 0x11);
+    const u8* written = memory->page(0x10);
+    memory->snapshot();
+
+    /* Snapshots take dirty pages over without copying them */
+    REQUIRE(memory->page(0x10) == written);
+
+    memory->write(0x2000, 0x22);
+    auto copy = std::make_unique<Memory>(*memory);
+
+    REQUIRE(*copy == *memory);
+    REQUIRE(copy->page(0x10) == memory->page(0x10));
+    REQUIRE(copy->page(0x20) != memory->page(0x20));
+    REQUIRE(copy->is_dirty(0x20));
+    REQUIRE(copy->dirty_count() == 1);
+
+    copy->write(0x1000, 0x33);
+    copy->write(0x2000, 0x44);
+
+    REQUIRE(memory->read(0x1000) == 0x11);
+    REQUIRE(memory->read(0x2000) == 0x22);
+    REQUIRE(memory->dirty_count() == 1);
+    REQUIRE(copy->read(0x1000) == 0x33);
+    REQUIRE(copy->page(0x10) != memory->page(0x10));
+
+    u8 bytes[4] {};
+    copy->read(0x1FFE, bytes, 4);
+    REQUIRE(bytes[2] == 0x44);
+
+    Memory moved { std::move(*copy) };
+    REQUIRE(moved.read(0x2000) == 0x44);
+    REQUIRE(*copy == Memory {});
+}
+
+TEST_CASE("Forks share pages until written") {
+    auto parent = std::make_unique<Mcu>();
+    parent->engine = Mcu::Engine::Threaded;
+    parent->load_program({
+        LDI, 0x0C, 0x10,
+        LDI, 0x0D, 0x00,
+        ST,  0x00,
+        INC, 0x00,
+        INC, 0x0C,
+        JMP, 0x00, 0x06,
+    });
+    parent->run(16);
+    parent->snapshot();
+    parent->run(16);
+
+    /* The parent keeps its dirty pages, the child copies of them */
+    u32 dirty = parent->memory.dirty_count();
+    REQUIRE(dirty != 0);
+
+    auto child = parent->fork();
+
+    REQUIRE(parent->memory.dirty_count() == dirty);
+    REQUIRE(child->memory.dirty_count() == dirty);
+
+    REQUIRE(child->image == parent->image);
+    REQUIRE(child->engine == parent->engine);
+    REQUIRE(child->pc == parent->pc);
+    REQUIRE(child->registers == parent->registers);
+    REQUIRE(child->memory == parent->memory);
+    REQUIRE(child->memory[0x1100] == parent->memory[0x1100]);
+
+    /* Both continue on their own, pages neither of them writes stay shared */
+    parent->run(100);
+    child->registers[0] = 0x80;
+    child->run(100);
+
+    REQUIRE(parent->memory[0x1600] != child->memory[0x1600]);
+
+    auto parent_pages = parent->snapshot().memory;
+    auto child_pages = child->snapshot().memory;
+
+    REQUIRE((*parent_pages)[0x10] == (*child_pages)[0x10]);
+    REQUIRE((*parent_pages)[0x16] != (*child_pages)[0x16]);
+    REQUIRE((*parent_pages)[0x40] == nullptr);
+}
+
+TEST_CASE("Forks copy scheduled events and leave devices behind") {
+    auto parent = std::make_unique<Mcu>();
+    parent->load_program({ INC, 0x00, JMP, 0x00, 0x00 });
+
+    u32 parent_fired = 0;
+    parent->scheduler.schedule(100, [&parent_fired](u64) { parent_fired++; });
+    parent->run(50);
+
+    auto child = parent->fork();
+    REQUIRE(child->scheduler.next_deadline() == 100);
+
+    child->run(100);
+    REQUIRE(parent_fired == 1);
+    REQUIRE(parent->scheduler.next_deadline() == 100);
+
+    SECTION("devices") {
+        Buttons buttons { *parent, 0x01 };
+        buttons.queue({ { 60, 0, true }, { 200, 1, true } });
+        Serial serial { *parent, 0x10, 30 };
+        serial.input.push(0x41);
+        parent->run(20);
+
+        auto fork = parent->fork();
+
+        /* Nothing of the parent's devices is left in the fork */
+        REQUIRE(fork->attachments.empty());
+        REQUIRE(fork->io_handlers.find(0x01) == nullptr);
+        REQUIRE(fork->io_handlers.find(0x10) == nullptr);
+        REQUIRE(fork->scheduler.size() == 1);
+        REQUIRE(parent->attachments.size() == 2);
+        REQUIRE(parent->scheduler.size() == 3);
+
+        /* Copies carry on where the parent's are, each side on its own */
+        Buttons fork_buttons { *fork, buttons };
+        Serial fork_serial { *fork, serial };
+        REQUIRE(fork_buttons.state() == buttons.state());
+        REQUIRE(fork_buttons.queued() == buttons.queued());
+        REQUIRE(fork->scheduler.size() == 3);
+
+        fork_buttons.queue({ 150, 2, true });
+        fork_serial.input.push(0x42);
+        parent->run(200);
+        fork->run(200);
+
+        REQUIRE(buttons.state() == 0x03);
+        REQUIRE(fork_buttons.state() == 0x07);
+        REQUIRE((serial.status() & SERIAL_RX_READY) != 0);
+        REQUIRE((fork_serial.status() & SERIAL_RX_READY) != 0);
+    }
+}
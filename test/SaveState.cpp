@@ -0,0 +1,161 @@
+#include "catch.hpp"
+
+#include <sstream>
+
+#include <Mcu.hpp>
+#include <SaveState.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+TEST_CASE("Save states round-trip") {
+    const std::vector<u8> program {
+        LDI, 0x0C, 0x40,
+        LDI, 0x0D, 0x00,
+        LDI, 0x00, 0x01,
+        ST,  0x00,
+        INC, 0x0D,
+        INC, 0x00,
+        CPI, 0x0D, 0x10,
+        BRNZ, 0x00, 0x09,
+        PUSH, 0x00,
+        SEI,
+        SLEEP,
+    };
+
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(program);
+    mcu->run(1000);
+    mcu->raise_interrupts(1u << BUTTON_INTERRUPT);
+    mcu->flags.carry = true;
+
+    SaveState state;
+
+    u32 device = 0xCAFEBABE;
+    state.add_device({ 'T', 'E', 'S', 'T' },
+        [&device](StateWriter& writer) { writer.write_u32(device); },
+        [&device](StateReader& reader) { device = reader.read_u32(); }
+    );
+
+    std::stringstream stream;
+    state.save(stream, *mcu);
+
+    /* Header, core, two memory spans, device and end */
+    REQUIRE(stream.str().size() < 150);
+
+    auto loaded = std::make_unique<Mcu>();
+    loaded->load_program(program);
+    loaded->memory.write(0x1234, 0x56);
+    device = 0;
+
+    state.load(stream, *loaded);
+
+    REQUIRE(loaded->pc == mcu->pc);
+    REQUIRE(loaded->sp == mcu->sp);
+    REQUIRE(loaded->registers == mcu->registers);
+    REQUIRE(loaded->flags.carry);
+    REQUIRE(loaded->flags.interrupt);
+    REQUIRE(loaded->interrupts.button());
+    REQUIRE(loaded->sleeping);
+    REQUIRE(loaded->cycles == mcu->cycles);
+    REQUIRE(loaded->instructions == mcu->instructions);
+    REQUIRE(loaded->memory == mcu->memory);
+    REQUIRE(loaded->memory[0x1234] == 0x00);
+    REQUIRE(loaded->memory[0x400F] == 0x10);
+    REQUIRE(device == 0xCAFEBABE);
+}
+
+TEST_CASE("Save states survive unknown chunks and reject garbage") {
+    auto mcu = std::make_unique<Mcu>();
+    mcu->registers[3] = 0x33;
+
+    std::stringstream stream;
+    SaveState with_device;
+    with_device.add_device({ 'X', 'T', 'R', 'A' }, [](StateWriter& writer) { writer.write_u64(42); }, [](StateReader&) { });
+    with_device.save(stream, *mcu);
+
+    auto loaded = std::make_unique<Mcu>();
+    SaveState {}.load(stream, *loaded);
+    REQUIRE(loaded->registers[3] == 0x33);
+
+    std::stringstream garbage { "MCUX" };
+    REQUIRE_THROWS_AS(SaveState {}.load(garbage, *loaded), save_state_error);
+
+    std::string truncated = [&mcu]() {
+        std::stringstream out;
+        SaveState {}.save(out, *mcu);
+        return out.str();
+    }();
+    std::stringstream short_stream { truncated.substr(0, truncated.size() - 3) };
+    REQUIRE_THROWS_AS(SaveState {}.load(short_stream, *loaded), save_state_error);
+}
+
+TEST_CASE("Save states load whole or not at all") {
+    auto mcu = std::make_unique<Mcu>();
+    mcu->registers[3] = 0x33;
+    mcu->memory.write(0x4000, 0x77);
+    mcu->raise_interrupts(1u << VBLANK_INTERRUPT);
+
+    u32 first = 0x11111111;
+    u32 second = 0x22222222;
+    SaveState state;
+    state.add_device({ 'O', 'N', 'E', ' ' },
+        [&first](StateWriter& writer) { writer.write_u32(first); },
+        [&first](StateReader& reader) { first = reader.read_u32(); }
+    );
+    state.add_device({ 'T', 'W', 'O', ' ' },
+        [&second](StateWriter& writer) { writer.write_u32(second); },
+        [&second](StateReader& reader) {
+            u32 value = reader.read_u32();
+            if (value == 0) {
+                throw save_state_error { "Malformed TWO chunk" };
+            }
+            second = value;
+        }
+    );
+
+    auto saved = [&state, &mcu]() {
+        std::stringstream out;
+        state.save(out, *mcu);
+        return out.str();
+    };
+
+    auto loaded = std::make_unique<Mcu>();
+    loaded->registers[3] = 0x44;
+    loaded->memory.write(0x5000, 0x88);
+
+    std::string bytes;
+
+    SECTION("with a malformed device chunk after the others") {
+        second = 0;
+        bytes = saved();
+        first = 0x33333333;
+    }
+
+    SECTION("with pending interrupts that do not exist") {
+        bytes = saved();
+        /* Magic, version, CORE header, pc, sp, registers and flags */
+        bytes[4 + 2 + 8 + 2 + 2 + 16 + 1] = static_cast<char>(0xFF);
+        first = 0x33333333;
+    }
+
+    SECTION("with a chunk longer than the stream") {
+        /* In place of the end chunk */
+        bytes = saved();
+        bytes.resize(bytes.size() - 8);
+        bytes += std::string { 'T', 'W', 'O', ' ', '\xF0', '\xFF', '\xFF', '\xFF', 0x01, 0x02 };
+        first = 0x33333333;
+        second = 0x44444444;
+    }
+
+    std::stringstream stream { bytes };
+    u32 first_before = first;
+    u32 second_before = second;
+    REQUIRE_THROWS_AS(state.load(stream, *loaded), save_state_error);
+
+    REQUIRE(first == first_before);
+    REQUIRE(second == second_before);
+    REQUIRE(loaded->registers[3] == 0x44);
+    REQUIRE(loaded->pending_interrupts() == 0);
+    REQUIRE(loaded->memory[0x4000] == 0x00);
+    REQUIRE(loaded->memory[0x5000] == 0x88);
+}
@@ -0,0 +1,134 @@
+#include "catch.hpp"
+
+#include <Mcu.hpp>
+#include <Scheduler.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+#include "programs.hpp"
+
+TEST_CASE("Scheduler") {
+    SECTION("order") {
+        Scheduler scheduler;
+        std::vector<int> fired;
+
+        scheduler.schedule(30, [&fired](u64) { fired.push_back(3); });
+        scheduler.schedule(10, [&fired](u64) { fired.push_back(1); });
+        scheduler.schedule(20, [&fired](u64) { fired.push_back(2); });
+        scheduler.schedule(20, [&fired](u64) { fired.push_back(4); });
+        auto id = scheduler.schedule(15, [&fired](u64) { fired.push_back(5); });
+
+        REQUIRE(scheduler.size() == 5);
+        REQUIRE(scheduler.cancel(id));
+        REQUIRE_FALSE(scheduler.cancel(id));
+        REQUIRE(scheduler.size() == 4);
+        REQUIRE(scheduler.next_deadline() == 10);
+
+        scheduler.run_due(9);
+        REQUIRE(fired.empty());
+
+        scheduler.run_due(20);
+        REQUIRE(fired == std::vector<int> { 1, 2, 4 });
+        REQUIRE(scheduler.next_deadline() == 30);
+
+        scheduler.run_due(100);
+        REQUIRE(fired == std::vector<int> { 1, 2, 4, 3 });
+        REQUIRE(scheduler.next_deadline() == Scheduler::never);
+        REQUIRE(scheduler.size() == 0);
+    }
+
+    SECTION("periodic") {
+        Scheduler scheduler;
+        std::vector<u64> fired;
+
+        std::function<void(u64)> tick = [&](u64 cycle) {
+            fired.push_back(cycle);
+            scheduler.schedule(cycle + 10, tick);
+        };
+        scheduler.schedule(10, tick);
+
+        /* Late by a few cycles, the next tick still lands on its period */
+        scheduler.run_due(13);
+        scheduler.run_due(25);
+        scheduler.run_due(45);
+        REQUIRE(fired == std::vector<u64> { 10, 20, 30, 40 });
+        REQUIRE(scheduler.next_deadline() == 50);
+    }
+
+    SECTION("watches") {
+        Scheduler scheduler;
+        std::vector<u64> seen;
+
+        auto id = scheduler.watch([&seen](u64 cycle) { seen.push_back(cycle); });
+        REQUIRE(scheduler.size() == 0);
+        REQUIRE(scheduler.next_deadline() == Scheduler::never);
+
+        scheduler.run_due(5);
+        scheduler.run_due(7);
+        REQUIRE(seen == std::vector<u64> { 5, 7 });
+
+        REQUIRE(scheduler.cancel(id));
+        REQUIRE_FALSE(scheduler.cancel(id));
+        scheduler.run_due(9);
+        REQUIRE(seen == std::vector<u64> { 5, 7 });
+    }
+
+    SECTION("run loop") {
+        std::vector<u8> program = program_with({
+            { 0x00, { SEI, SLEEP, JMP, 0x00, 0x01 } },
+            { VBLANK_VECTOR, { INC, 0x05, RETI } },
+        });
+
+        for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+            auto mcu = std::make_unique<Mcu>();
+            mcu->load_program(program);
+            mcu->engine = engine;
+
+            std::vector<u64> fired;
+            std::function<void(u64)> vblank = [&](u64 cycle) {
+                fired.push_back(mcu->cycles);
+                mcu->raise_interrupts(1u << VBLANK_INTERRUPT);
+                mcu->scheduler.schedule(cycle + 100, vblank);
+            };
+            mcu->scheduler.schedule(100, vblank);
+
+            auto result = mcu->run(1050);
+
+            /* Sleeping in between, so every event fires on its cycle */
+            REQUIRE(result.reason == Mcu::StopReason::Budget);
+            REQUIRE(fired == std::vector<u64> { 100, 200, 300, 400, 500, 600, 700, 800, 900, 1000 });
+            REQUIRE(mcu->registers[5] == 10);
+            REQUIRE(mcu->sleeping);
+        }
+    }
+
+    SECTION("scheduled from a port handler") {
+        std::vector<u8> program {
+            INC, 0x01,
+            OUT, 0x01, 0x01,
+            JMP, 0x00, 0x00,
+        };
+
+        for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+            auto mcu = std::make_unique<Mcu>();
+            mcu->load_program(program);
+            mcu->engine = engine;
+
+            u64 due = 0;
+            std::vector<u64> fired;
+            mcu->io_handlers[0x01].set = [&](u8) {
+                if (due == 0) {
+                    due = mcu->cycles + 10;
+                    mcu->scheduler.schedule(due, [&](u64) { fired.push_back(mcu->cycles); });
+                }
+            };
+
+            mcu->run(100000);
+
+            /* On time, not when run() comes back */
+            REQUIRE(fired.size() == 1);
+            REQUIRE(fired[0] >= due);
+            REQUIRE(fired[0] < due + 8);
+        }
+    }
+}
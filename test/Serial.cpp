@@ -0,0 +1,286 @@
+#include "catch.hpp"
+
+#include <numeric>
+#include <sstream>
+#include <thread>
+
+#include <Mcu.hpp>
+#include <SaveState.hpp>
+#include <Serial.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+#include "programs.hpp"
+
+TEST_CASE("Byte rings") {
+    ByteRing ring { 5 };
+    REQUIRE(ring.capacity() == 8);
+
+    std::vector<u8> data(20);
+    std::iota(data.begin(), data.end(), 0);
+
+    /* Wrap around a few times */
+    std::vector<u8> received;
+    for (size_t sent = 0; sent < data.size(); ) {
+        sent += ring.write(&data[sent], std::min<size_t>(5, data.size() - sent));
+
+        u8 buffer[3] = {};
+        size_t count = ring.read(buffer, sizeof(buffer));
+        received.insert(received.end(), buffer, buffer + count);
+    }
+    for (u8 value = 0; ring.pop(value); ) {
+        received.push_back(value);
+    }
+
+    REQUIRE(received == data);
+    REQUIRE(ring.empty());
+
+    for (u8 i = 0; i < 8; i++) {
+        REQUIRE(ring.push(i));
+    }
+    REQUIRE_FALSE(ring.push(8));
+    REQUIRE(ring.size() == 8);
+}
+
+TEST_CASE("Serial port") {
+    const u8 data = 0x10;
+    const u8 status = 0x11;
+
+    SECTION("echo by interrupt") {
+        auto mcu = std::make_unique<Mcu>();
+        mcu->engine = Mcu::Engine::Threaded;
+        mcu->load_program(program_with({
+            { 0x00, { JMP, 0x00, 0x50 } },
+            { SERIAL_VECTOR, { IN, 0x00, data, OUT, 0x00, data, RETI } },
+            { 0x50, {
+                LDI, 0x01, SERIAL_RX_INTERRUPT,
+                OUT, 0x01, status,
+                SEI,
+                SLEEP,
+                JMP, 0x00, 0x57,
+            } },
+        }));
+
+        Serial serial { *mcu, data, 100 };
+
+        std::vector<u8> sent(1000);
+        std::iota(sent.begin(), sent.end(), 0);
+        REQUIRE(serial.input.write(sent.data(), sent.size()) == sent.size());
+
+        /* A byte arrives every 100 cycles, the handler takes a few and
+         * sending it back 100 more */
+        mcu->run(50 * 100);
+        REQUIRE(serial.output.size() == 48);
+
+        mcu->run(950 * 100 + 200);
+
+        std::vector<u8> received(sent.size() + 1);
+        received.resize(serial.output.read(received.data(), received.size()));
+        REQUIRE(received == sent);
+        REQUIRE(serial.status() == (SERIAL_TX_READY | SERIAL_TX_IDLE));
+    }
+
+    SECTION("idle") {
+        auto mcu = std::make_unique<Mcu>();
+        mcu->load_program(program_with({
+            { 0x00, { JMP, 0x00, 0x50 } },
+            { SERIAL_VECTOR, { IN, 0x00, data, RETI } },
+            { 0x50, {
+                LDI, 0x01, SERIAL_RX_INTERRUPT,
+                OUT, 0x01, status,
+                SEI,
+                SLEEP,
+                JMP, 0x00, 0x57,
+            } },
+        }));
+
+        Serial serial { *mcu, data, 100 };
+
+        /* Nothing to receive, nothing scheduled, so sleep skips ahead */
+        auto result = mcu->run(1'000'000);
+        REQUIRE(result.cycles == 1'000'000);
+        REQUIRE(result.instructions < 10);
+        REQUIRE(mcu->scheduler.size() == 0);
+
+        /* Picked up at the start of the next run, a byte time later */
+        REQUIRE(serial.input.write(reinterpret_cast<const u8*>("ab"), 2) == 2);
+        mcu->run(150);
+        REQUIRE(mcu->registers[0] == 'a');
+        mcu->run(100);
+        REQUIRE(mcu->registers[0] == 'b');
+
+        mcu->run(1000);
+        REQUIRE(mcu->scheduler.size() == 0);
+    }
+
+    SECTION("save states") {
+        /* Sends three bytes, then stores what has arrived whenever the
+         * transmitter goes idle */
+        const std::vector<u8> program = program_with({
+            { 0x00, { JMP, 0x00, 0x50 } },
+            { SERIAL_VECTOR, { JMP, 0x00, 0x80 } },
+            { 0x50, {
+                LDI, 0x0C, 0x40,
+                LDI, 0x01, SERIAL_TX_INTERRUPT,
+                OUT, 0x01, status,
+                LDI, 0x00, 'x',
+                OUT, 0x00, data,
+                OUT, 0x00, data,
+                OUT, 0x00, data,
+                SEI,
+                SLEEP,
+                JMP, 0x00, 0x66,
+            } },
+            { 0x80, {
+                INC, 0x05,
+                IN,  0x01, status,
+                LDI, 0x02, SERIAL_RX_READY,
+                AND, 0x12,
+                BRZ, 0x00, 0x97,
+                IN,  0x00, data,
+                ST,  0x00,
+                INC, 0x0D,
+                JMP, 0x00, 0x82,
+                RETI,
+            } },
+        });
+
+        auto mcu = std::make_unique<Mcu>();
+        mcu->load_program(program);
+        Serial serial { *mcu, data, 100 };
+        SaveState state;
+        serial.add_to(state);
+
+        const std::string text = "hello world";
+        serial.input.write(reinterpret_cast<const u8*>(text.data()), text.size());
+
+        /* A byte received, two waiting to be sent, both lines mid byte */
+        mcu->run(150);
+        REQUIRE(serial.status() == (SERIAL_RX_READY | SERIAL_TX_READY));
+
+        u8 sent[4] = {};
+        REQUIRE(serial.output.read(sent, sizeof(sent)) == 1);
+
+        std::stringstream stream;
+        state.save(stream, *mcu);
+
+        auto loaded = std::make_unique<Mcu>();
+        loaded->load_program(program);
+        Serial loaded_serial { *loaded, data, 100 };
+        SaveState loaded_state;
+        loaded_serial.add_to(loaded_state);
+        loaded_state.load(stream, *loaded);
+        REQUIRE(loaded_serial.status() == serial.status());
+
+        /* The host side is not saved, so both get the rest of the input */
+        std::vector<u8> rest(serial.input.size());
+        serial.input.read(rest.data(), rest.size());
+        serial.input.write(rest.data(), rest.size());
+        loaded_serial.input.write(rest.data(), rest.size());
+
+        mcu->run(2000);
+        loaded->run(2000);
+        REQUIRE(mcu->registers[13] > 1);
+        REQUIRE(mcu->memory[0x4000] == 'h');
+        REQUIRE(loaded->registers == mcu->registers);
+        REQUIRE(loaded->memory == mcu->memory);
+        REQUIRE(loaded->cycles == mcu->cycles);
+        REQUIRE(loaded_serial.status() == serial.status());
+
+        REQUIRE(serial.output.read(sent, sizeof(sent)) == 2);
+        REQUIRE(loaded_serial.output.read(sent + 2, 2) == 2);
+        REQUIRE(std::equal(sent, sent + 2, sent + 2));
+
+        /* More bytes in a FIFO than it holds */
+        SaveState bad;
+        bad.add_device({ 'U', 'A', 'R', 'T' }, [](StateWriter& writer) {
+            writer.write_u8(0);
+            writer.write_u8(Serial::fifo_size + 1);
+        }, [](StateReader&) { });
+
+        std::stringstream bad_stream;
+        bad.save(bad_stream, *loaded);
+        u8 before = loaded_serial.status();
+        REQUIRE_THROWS_AS(loaded_state.load(bad_stream, *loaded), save_state_error);
+        REQUIRE(loaded_serial.status() == before);
+    }
+
+    SECTION("transmit FIFO") {
+        auto mcu = std::make_unique<Mcu>();
+        mcu->load_program(program_with({
+            { 0x00, {
+                LDI, 0x00, 0x41,
+                OUT, 0x00, data,
+                INC, 0x00,
+                IN,  0x01, status,
+                LDI, 0x02, SERIAL_TX_READY,
+                AND, 0x12,
+                BRNZ, 0x00, 0x03,
+                BREAK,
+            } },
+        }));
+
+        Serial serial { *mcu, data, 1000 };
+
+        /* Fills the FIFO well before the first byte is out */
+        REQUIRE(mcu->run(1000).reason == Mcu::StopReason::Break);
+        REQUIRE(serial.status() == 0);
+        REQUIRE(serial.output.empty());
+
+        mcu->run(16 * 1000);
+        REQUIRE(serial.status() == (SERIAL_TX_READY | SERIAL_TX_IDLE));
+
+        u8 sent[Serial::fifo_size] = {};
+        REQUIRE(serial.output.read(sent, sizeof(sent)) == Serial::fifo_size);
+        REQUIRE(sent[0] == 0x41);
+        REQUIRE(sent[Serial::fifo_size - 1] == 0x41 + Serial::fifo_size - 1);
+    }
+
+    SECTION("streaming from another thread") {
+        for (auto engine : { Mcu::Engine::Switch, Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+            auto mcu = std::make_unique<Mcu>();
+            mcu->engine = engine;
+
+            /* Polling echo */
+            mcu->load_program(program_with({
+                { 0x00, {
+                    IN,  0x01, status,
+                    LDI, 0x02, SERIAL_RX_READY,
+                    AND, 0x12,
+                    BRZ, 0x00, 0x00,
+                    IN,  0x00, data,
+                    OUT, 0x00, data,
+                    JMP, 0x00, 0x00,
+                } },
+            }));
+
+            /* Small rings, so both sides keep waiting for each other, drained
+             * before the transmitter can back up into the FIFO */
+            Serial serial { *mcu, data, 40, 64 };
+
+            std::vector<u8> sent(0x4000);
+            for (size_t i = 0; i < sent.size(); i++) {
+                sent[i] = static_cast<u8>(i * 7 + i / 256);
+            }
+
+            std::thread host { [&serial, &sent]() {
+                for (size_t i = 0; i < sent.size(); ) {
+                    i += serial.input.write(&sent[i], sent.size() - i);
+                    std::this_thread::yield();
+                }
+            } };
+
+            std::vector<u8> received;
+            while (received.size() < sent.size()) {
+                mcu->run(1000);
+
+                u8 buffer[256];
+                size_t count = serial.output.read(buffer, sizeof(buffer));
+                received.insert(received.end(), buffer, buffer + count);
+            }
+            host.join();
+
+            REQUIRE(received == sent);
+        }
+    }
+}
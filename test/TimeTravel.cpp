@@ -0,0 +1,260 @@
+#include "catch.hpp"
+
+#include <cstring>
+
+#include <Mcu.hpp>
+#include <Serial.hpp>
+#include <TimeTravel.hpp>
+#include <interrupts.hpp>
+#include <opcodes.hpp>
+
+#include "programs.hpp"
+
+namespace {
+    struct State {
+        u16 pc;
+        u16 sp;
+        std::array<u8, 16> registers;
+        u8 pending;
+        u64 cycles;
+        u64 instructions;
+        std::vector<u8> memory;
+
+        bool operator==(const State& other) const {
+            return this->pc == other.pc && this->sp == other.sp && this->registers == other.registers
+                && this->pending == other.pending && this->cycles == other.cycles
+                && this->instructions == other.instructions && this->memory == other.memory;
+        }
+    };
+
+    State capture(const Mcu& mcu) {
+        std::vector<u8> memory(Memory::size);
+        mcu.memory.read(0, memory.data(), Memory::size);
+
+        return State {
+            .pc = mcu.pc,
+            .sp = mcu.sp,
+            .registers = mcu.registers,
+            .pending = mcu.pending_interrupts(),
+            .cycles = mcu.cycles,
+            .instructions = mcu.instructions,
+            .memory = std::move(memory),
+        };
+    }
+}
+
+TEST_CASE("Time travel") {
+    std::vector<u8> program = program_with({
+        { 0x00, { JMP, 0x00, 0x50 } },
+        { VBLANK_VECTOR, { INC, 0x05, RETI } },
+        { BUTTON_VECTOR, { INC, 0x06, RETI } },
+        { 0x50, {
+            LDI, 0x0C, 0x40,
+            LDI, 0x0D, 0x00,
+            SEI,
+            IN,  0x00, 0x01,
+            ST,  0x00,
+            INC, 0x0D,
+            OUT, 0x00, 0x02,
+            ADD, 0x10,
+            JMP, 0x00, 0x57,
+        } },
+    });
+
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(program);
+
+    /* Impure input, and output raising an interrupt now and then */
+    u32 reads = 0;
+    u32 writes = 0;
+    mcu->io_handlers[0x01].get = [&reads]() { return static_cast<u8>(++reads * 3); };
+    mcu->io_handlers[0x02].set = [&writes, &mcu](u8 value) {
+        writes++;
+        if (value % 5 == 0) {
+            mcu->raise_interrupts(1u << BUTTON_INTERRUPT);
+        }
+    };
+
+    TimeTravel travel { *mcu, 50, 16 };
+
+    std::vector<State> states { capture(*mcu) };
+    for (int i = 0; i < 40; i++) {
+        if (i % 3 == 0) {
+            mcu->raise_interrupts(1u << VBLANK_INTERRUPT);
+        }
+        travel.run(37);
+        states.push_back(capture(*mcu));
+    }
+
+    const State now = states.back();
+    const u32 recorded_reads = reads;
+    const u32 recorded_writes = writes;
+
+    REQUIRE(mcu->registers[5] > 0);
+    REQUIRE(mcu->registers[6] > 0);
+
+    SECTION("reverse_step") {
+        for (auto it = states.rbegin() + 1; it != states.rend() && it->instructions >= travel.oldest_instruction(); ++it) {
+            REQUIRE(travel.reverse_step(mcu->instructions - it->instructions));
+            REQUIRE(capture(*mcu) == *it);
+        }
+
+        REQUIRE(travel.oldest_instruction() > 0);
+        REQUIRE_FALSE(travel.reverse_step(mcu->instructions - travel.oldest_instruction() + 1));
+
+        /* Forward again replays up to where recording stopped */
+        travel.run(now.cycles - mcu->cycles);
+        REQUIRE(capture(*mcu) == now);
+        REQUIRE(reads == recorded_reads);
+        REQUIRE(writes == recorded_writes);
+
+        /* And then goes live */
+        travel.run(100);
+        REQUIRE(reads > recorded_reads);
+        REQUIRE(writes > recorded_writes);
+    }
+
+    SECTION("reverse_step one instruction at a time") {
+        const State& previous = states[states.size() - 2];
+        while (mcu->instructions > previous.instructions) {
+            u64 instructions = mcu->instructions;
+            REQUIRE(travel.reverse_step());
+            REQUIRE(mcu->instructions == instructions - 1);
+        }
+        REQUIRE(capture(*mcu) == previous);
+        REQUIRE(reads == recorded_reads);
+    }
+
+    SECTION("reverse_continue") {
+        /* Interrupt entry comes with the first instruction of the handler */
+        const u16 reti = VBLANK_VECTOR + 2;
+
+        REQUIRE(travel.reverse_continue([reti](const McuBase& mcu) { return mcu.pc == reti; }));
+        REQUIRE(mcu->pc == reti);
+
+        /* It was the last time before now */
+        while (mcu->instructions < now.instructions - 1) {
+            travel.run(1);
+            REQUIRE(mcu->pc != reti);
+        }
+        travel.run(1);
+        REQUIRE(capture(*mcu) == now);
+
+        REQUIRE_FALSE(travel.reverse_continue([](const McuBase& mcu) { return mcu.registers[0] == 0xFF && mcu.pc == 0x00; }));
+        REQUIRE(mcu->instructions == travel.oldest_instruction());
+        REQUIRE(reads == recorded_reads);
+        REQUIRE(writes == recorded_writes);
+    }
+
+    SECTION("forks run unrecorded") {
+        mcu->request_interrupts(1u << VBLANK_INTERRUPT);
+        auto fork = mcu->fork();
+
+        REQUIRE(fork->tap == nullptr);
+        REQUIRE_FALSE(fork->hold_requests);
+        REQUIRE(fork->interrupts.vblank());
+        REQUIRE(mcu->tap != nullptr);
+
+        fork->run(100);
+        REQUIRE(reads > recorded_reads);
+        REQUIRE(mcu->instructions == now.instructions);
+    }
+}
+
+TEST_CASE("Time travel through skipped poll loops") {
+    for (auto engine : { Mcu::Engine::Threaded, Mcu::Engine::Jit }) {
+        /* Waits for port 0x01 to change, counting changes in r5 */
+        auto mcu = std::make_unique<Mcu>();
+        mcu->engine = engine;
+        mcu->load_program(program_with({
+            { 0x00, {
+                IN,   0x00, 0x01,
+                CPI,  0x00, 0x00,
+                BRZ,  0x00, 0x00,
+                INC,  0x05,
+                IN,   0x00, 0x01,
+                CPI,  0x00, 0x00,
+                BRNZ, 0x00, 0x0B,
+                JMP,  0x00, 0x00,
+            } },
+        }));
+
+        u8 level = 0x00;
+        mcu->io_handlers[0x01] = IoHandler {
+            .get = [&level]() { return level; },
+            .pure = true,
+        };
+
+        TimeTravel travel { *mcu, 1000, 16 };
+
+        std::vector<State> states { capture(*mcu) };
+        for (int i = 0; i < 12; i++) {
+            level = static_cast<u8>(i % 2);
+            travel.run(700);
+            states.push_back(capture(*mcu));
+        }
+
+        const State now = states.back();
+        REQUIRE(mcu->registers[5] == 6);
+
+        /* Stepping back one instruction at a time goes through every
+         * iteration skipped */
+        const State& previous = states[states.size() - 2];
+        while (mcu->instructions > previous.instructions) {
+            u64 instructions = mcu->instructions;
+            REQUIRE(travel.reverse_step());
+            REQUIRE(mcu->instructions == instructions - 1);
+        }
+        REQUIRE(capture(*mcu) == previous);
+
+        for (auto it = states.rbegin() + 2; it != states.rend() && it->instructions >= travel.oldest_instruction(); ++it) {
+            REQUIRE(travel.reverse_step(mcu->instructions - it->instructions));
+            REQUIRE(capture(*mcu) == *it);
+        }
+
+        /* Replaying does not read the port */
+        level = 0xFF;
+        travel.run(now.cycles - mcu->cycles);
+        REQUIRE(capture(*mcu) == now);
+    }
+}
+
+TEST_CASE("Time travel through events scheduled in a run") {
+    /* Sends a byte with the transmitter interrupt enabled, counting
+     * interrupts in r5 */
+    auto mcu = std::make_unique<Mcu>();
+    mcu->load_program(program_with({
+        { 0x00, { JMP, 0x00, 0x50 } },
+        { SERIAL_VECTOR, { INC, 0x05, RETI } },
+        { 0x50, {
+            LDI, 0x01, SERIAL_TX_INTERRUPT,
+            OUT, 0x01, 0x11,
+            SEI,
+            LDI, 0x02, 0x41,
+            OUT, 0x02, 0x10,
+            INC, 0x00,
+            JMP, 0x00, 0x5C,
+        } },
+    }));
+    Serial serial { *mcu, 0x10, 100 };
+
+    /* Checkpoints far enough apart for the byte to go out between two */
+    TimeTravel travel { *mcu, 1000, 4 };
+    travel.run(1000);
+
+    const State now = capture(*mcu);
+    REQUIRE(mcu->registers[5] == 2);
+    REQUIRE(travel.oldest_instruction() == 0);
+
+    while (mcu->instructions > 0) {
+        u64 instructions = mcu->instructions;
+        REQUIRE(travel.reverse_step());
+        REQUIRE(mcu->instructions == instructions - 1);
+    }
+    REQUIRE(mcu->registers[5] == 0);
+
+    /* Replaying raises the interrupts again */
+    travel.run(now.cycles - mcu->cycles);
+    REQUIRE(capture(*mcu) == now);
+    REQUIRE(serial.output.size() == 1);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <algorithm>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include <opcodes.hpp>
+#include <typedefs.hpp>
+
+/* Program with each part's bytes at its address and NOPs in between, for
+ * placing interrupt handlers at their vectors */
+inline std::vector<u8> program_with(std::initializer_list<std::pair<u16, std::vector<u8>>> parts) {
+    std::vector<u8> program;
+    for (const auto& [addr, bytes] : parts) {
+        if (program.size() < addr + bytes.size()) {
+            program.resize(addr + bytes.size(), NOP);
+        }
+        std::copy(bytes.begin(), bytes.end(), program.begin() + addr);
+    }
+    return program;
+}